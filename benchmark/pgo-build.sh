@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# Build mucalc-pgo: an instrumented build runs the benchmark workloads as
+# training corpus, then mucalc is rebuilt with the recorded profile and
+# link-time optimization, and both builds are compared with run.sh.
+#
+# Usage: pgo-build.sh [BUILD_DIR] [CMAKE_ARGS...]
+
+set -e
+
+SOURCE_DIR=$(cd "$(dirname "$0")/.." && pwd)
+BUILD_DIR=${1:-build-pgo}
+[ $# -gt 0 ] && shift
+
+cmake -S "$SOURCE_DIR" -B "$BUILD_DIR/default" -DCMAKE_BUILD_TYPE=Release "$@"
+cmake --build "$BUILD_DIR/default"
+
+cmake -S "$SOURCE_DIR" -B "$BUILD_DIR/pgo" -DCMAKE_BUILD_TYPE=Release -DMUCALC_PGO=generate "$@"
+cmake --build "$BUILD_DIR/pgo"
+cmake --build "$BUILD_DIR/pgo" --target pgo-train
+cmake -S "$SOURCE_DIR" -B "$BUILD_DIR/pgo" -DMUCALC_PGO=use
+cmake --build "$BUILD_DIR/pgo"
+cp "$BUILD_DIR/pgo/mucalc" "$BUILD_DIR/mucalc-pgo"
+
+"$SOURCE_DIR/benchmark/run.sh" "$BUILD_DIR/default/mucalc" "$BUILD_DIR/mucalc-pgo"
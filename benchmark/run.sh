@@ -0,0 +1,94 @@
+#!/bin/sh
+#
+# Benchmark workloads for mucalc. The same workloads serve as the training
+# corpus for profile-guided optimization (see pgo-build.sh).
+#
+# Usage: run.sh [--train] MUCALC...
+#
+# Each workload is run with each given binary, and the best wall clock time
+# of several repetitions is printed. With --train, each workload is run once
+# with the first binary and no times are printed.
+
+set -e
+
+BENCHMARK_DIR=$(cd "$(dirname "$0")" && pwd)
+REPETITIONS=5
+TRAIN=0
+if [ "$1" = "--train" ]; then
+    TRAIN=1
+    REPETITIONS=1
+    shift
+fi
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 [--train] MUCALC..." >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+# Input streams: the expression corpus repeated, as a script or pipe would
+# provide it, and rows of values for column mode.
+i=0
+while [ $i -lt 500 ]; do
+    cat "$BENCHMARK_DIR/expressions.txt"
+    i=$((i + 1))
+done > "$WORK_DIR/lines.txt"
+awk 'BEGIN { for (i = 0; i < 200000; i++) printf "%g %g\n", i * 0.001, (i % 97) * 0.5 }' > "$WORK_DIR/rows.txt"
+awk 'BEGIN { for (i = 0; i < 200000; i++) printf "sin(%d*0.001)*cos(%d*0.002)+sqrt(%d)\n", i, i, i }' > "$WORK_DIR/independent.txt"
+# Huge generated lines of growing length, to check that the time grows
+# linearly with the length
+for n in 10000 100000 1000000; do
+    awk -v n=$n 'BEGIN { printf "sum("; for (i = 0; i < n; i++) printf "%s%.4f", (i ? "," : ""), i * 0.001; print ")" }' > "$WORK_DIR/sum-$n.txt"
+    awk -v n=$n 'BEGIN { printf "med("; for (i = 0; i < n; i++) printf "%s%d", (i ? "," : ""), (i * 7919) % n; print ")" }' > "$WORK_DIR/med-$n.txt"
+done
+LIST=$(awk 'BEGIN { for (i = 0; i < 2000; i++) printf "%ssum(%d,sin(%d),cos(%d))", (i ? "," : ""), i, i, i }')
+
+# workload NAME MUCALC INPUT ARGS...
+workload() {
+    name=$1
+    mucalc=$2
+    input=$3
+    shift 3
+    best=
+    r=0
+    while [ $r -lt $REPETITIONS ]; do
+        start=$(date +%s%N)
+        "$mucalc" "$@" < "$input" > /dev/null 2>&1 || true
+        end=$(date +%s%N)
+        t=$(( (end - start) / 1000000 ))
+        if [ -z "$best" ] || [ $t -lt $best ]; then
+            best=$t
+        fi
+        r=$((r + 1))
+    done
+    if [ $TRAIN -eq 0 ]; then
+        printf "%-40s %8d ms  %s\n" "$name" "$best" "$mucalc"
+    fi
+}
+
+run_all() {
+    workload "lines" "$1" "$WORK_DIR/lines.txt"
+    workload "lines-threads" "$1" "$WORK_DIR/lines.txt" --threads auto
+    workload "independent" "$1" "$WORK_DIR/independent.txt"
+    workload "independent-threads" "$1" "$WORK_DIR/independent.txt" --threads auto
+    workload "columns" "$1" "$WORK_DIR/rows.txt" --columns x,y 'smoothstep(0, 200, x) * y + clamp(sin(x), -0.5, 0.5)'
+    workload "list" "$1" /dev/null "$LIST"
+    for n in 10000 100000 1000000; do
+        workload "huge-sum-$n" "$1" "$WORK_DIR/sum-$n.txt"
+        workload "huge-med-$n" "$1" "$WORK_DIR/med-$n.txt"
+    done
+    # inputs found by the performance fuzzer (mucalc-fuzz)
+    for f in "$BENCHMARK_DIR"/regressions/*.txt; do
+        [ -e "$f" ] || continue
+        workload "$(basename "$f" .txt)" "$1" "$f"
+    done
+}
+
+if [ $TRAIN -eq 1 ]; then
+    run_all "$1"
+else
+    for mucalc in "$@"; do
+        run_all "$mucalc"
+    done
+fi
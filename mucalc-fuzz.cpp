@@ -0,0 +1,556 @@
+/*
+ * Copyright (C) 2015, 2016, 2018, 2019, 2020, 2021
+ * Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <random>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+/* performance fuzzing */
+
+// The mucalc-fuzz binary generates expressions of various shapes at growing
+// sizes and reports those whose parse and evaluation time grows faster than
+// their length, or that take too much time or memory per input byte.
+// Reported inputs are stored as regression cases for benchmark/run.sh.
+// Each input is evaluated by a mucalc binary as a line of standard input
+// with --profile, so that it takes the same path as in normal use (the
+// huge list fast path, the mucalc functions, ...), and the time and heap
+// allocations are taken from the profile report. The binary should be built
+// with MUCALC_COUNT_ALLOCATIONS, like the mucalc-counting target.
+
+struct FuzzOptions
+{
+    size_t iterations;
+    unsigned long seed;
+    size_t max_size;            // size of the larger input of each pair
+    double max_growth;          // allowed time growth relative to size growth
+    double max_ns_per_byte;
+    double max_bytes_per_byte;  // heap memory allocated per input byte
+    double min_seconds;         // times below this are too noisy to judge
+    std::string output_dir;
+    std::string mucalc;         // the binary under test
+
+    FuzzOptions() : iterations(200), seed(0), max_size(65536), max_growth(2.0),
+        max_ns_per_byte(2000.0), max_bytes_per_byte(1000.0), min_seconds(0.001),
+        output_dir("."), mucalc("mucalc-counting")
+    {
+    }
+};
+
+struct FuzzResult
+{
+    double seconds;     // best of several runs
+    size_t allocations;
+    size_t bytes;
+    bool error;
+};
+
+// Run mucalc --profile with the input file as standard input and return its
+// profile report from standard error. Returns false if mucalc cannot be run.
+static bool fuzz_run(const std::string& mucalc, const char* input_name, std::string& report, int* status)
+{
+    int report_pipe[2];
+    if (pipe(report_pipe) != 0)
+        return false;
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(report_pipe[0]);
+        close(report_pipe[1]);
+        return false;
+    }
+    if (pid == 0) {
+        int input = open(input_name, O_RDONLY);
+        int null = open("/dev/null", O_WRONLY);
+        if (input < 0 || null < 0 || dup2(input, 0) < 0 || dup2(null, 1) < 0 || dup2(report_pipe[1], 2) < 0)
+            _exit(127);
+        close(report_pipe[0]);
+        execl(mucalc.c_str(), mucalc.c_str(), "--profile", static_cast<char*>(NULL));
+        _exit(127);
+    }
+    close(report_pipe[1]);
+    report.clear();
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(report_pipe[0], buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+        if (n > 0)
+            report.append(buf, n);
+    close(report_pipe[0]);
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0)
+        if (errno != EINTR)
+            return false;
+    *status = (WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128);
+    return (*status != 127);
+}
+
+// Measure the input three times and keep the best time. Returns false if
+// mucalc cannot be run or does not report its profile.
+static bool fuzz_measure(const FuzzOptions& options, const std::string& expr, FuzzResult& r)
+{
+    r.seconds = 1e30;
+    r.allocations = 0;
+    r.bytes = 0;
+    r.error = false;
+    const char* tmpdir = getenv("TMPDIR");
+    std::string input_name = std::string(tmpdir && *tmpdir ? tmpdir : "/tmp") + "/mucalc-fuzz-XXXXXX";
+    int fd = mkstemp(&input_name[0]);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", input_name.c_str(), strerror(errno));
+        return false;
+    }
+    std::string line = expr + '\n';
+    bool ok = (write(fd, line.data(), line.size()) == static_cast<ssize_t>(line.size()));
+    ok = (close(fd) == 0) && ok;
+    for (int run = 0; run < 3 && ok; run++) {
+        std::string report;
+        int status;
+        if (!fuzz_run(options.mucalc, input_name.c_str(), report, &status)) {
+            fprintf(stderr, "Cannot run %s\n", options.mucalc.c_str());
+            ok = false;
+            break;
+        }
+        r.error = r.error || (status != 0);
+        bool timed = false;
+        for (size_t pos = 0; pos < report.size(); ) {
+            size_t line_end = report.find('\n', pos);
+            if (line_end == std::string::npos)
+                line_end = report.size();
+            std::string report_line = report.substr(pos, line_end - pos);
+            pos = line_end + 1;
+            size_t lines, allocations, bytes;
+            double seconds;
+            if (sscanf(report_line.c_str(), "Profile: %zu lines in %lf seconds", &lines, &seconds) == 2) {
+                r.seconds = std::min(r.seconds, seconds);
+                timed = true;
+            } else if (sscanf(report_line.c_str(), "Profile: %zu heap allocations of %zu bytes",
+                        &allocations, &bytes) == 2) {
+                r.allocations = allocations;
+                r.bytes = bytes;
+            }
+        }
+        if (!timed) {
+            fprintf(stderr, "%s did not report its profile\n", options.mucalc.c_str());
+            ok = false;
+        }
+    }
+    remove(input_name.c_str());
+    return ok;
+}
+
+static const char* fuzz_unary_functions[] = {
+    "sin", "cos", "sqrt", "abs", "exp", "ln", "floor", "deg", "fract",
+    "erf", "lgamma", "normcdf", "norminv", NULL
+};
+static const char* fuzz_variadic_functions[] = {
+    "sum", "min", "max", "avg", "med", NULL
+};
+static const char* fuzz_binary_operators[] = {
+    "+", "-", "*", "/", "^", "%", "<", ">=", "==", "&&", "||", NULL
+};
+
+static const char* fuzz_pick(const char** list, std::mt19937_64& rng)
+{
+    size_t n = 0;
+    while (list[n])
+        n++;
+    return list[rng() % n];
+}
+
+static void fuzz_atom(std::string& s, std::mt19937_64& rng)
+{
+    char buf[32];
+    switch (rng() % 4) {
+    case 0:
+        snprintf(buf, sizeof(buf), "%d", static_cast<int>(rng() % 1000));
+        break;
+    case 1:
+        snprintf(buf, sizeof(buf), "%.6g", std::uniform_real_distribution<double>(-1e3, 1e3)(rng));
+        break;
+    case 2:
+        snprintf(buf, sizeof(buf), "%s", rng() % 2 ? "pi" : "e");
+        break;
+    default:
+        snprintf(buf, sizeof(buf), "%c", static_cast<char>('a' + rng() % 4));
+        break;
+    }
+    s += buf;
+}
+
+// A random expression of about the given size
+static void fuzz_random(std::string& s, size_t size, std::mt19937_64& rng)
+{
+    if (size < 8) {
+        fuzz_atom(s, rng);
+        return;
+    }
+    switch (rng() % 5) {
+    case 0:
+        s += '(';
+        fuzz_random(s, size - 2, rng);
+        s += ')';
+        break;
+    case 1:
+        s += fuzz_pick(fuzz_unary_functions, rng);
+        s += '(';
+        fuzz_random(s, size - 6, rng);
+        s += ')';
+        break;
+    case 2:
+        {
+            s += fuzz_pick(fuzz_variadic_functions, rng);
+            s += '(';
+            size_t args = 1 + rng() % 8;
+            for (size_t i = 0; i < args; i++) {
+                if (i > 0)
+                    s += ',';
+                fuzz_random(s, (size - 6) / args, rng);
+            }
+            s += ')';
+        }
+        break;
+    case 3:
+        s += '(';
+        fuzz_random(s, size / 3, rng);
+        s += ")?(";
+        fuzz_random(s, size / 3, rng);
+        s += "):(";
+        fuzz_random(s, size / 3, rng);
+        s += ')';
+        break;
+    default:
+        fuzz_random(s, size / 2, rng);
+        s += fuzz_pick(fuzz_binary_operators, rng);
+        fuzz_random(s, size / 2, rng);
+        break;
+    }
+}
+
+// Generators of specific shapes; each appends an expression of about the
+// given size to the string
+static void fuzz_shape_random(std::string& s, size_t size, std::mt19937_64& rng)
+{
+    fuzz_random(s, size, rng);
+}
+
+static void fuzz_shape_nesting(std::string& s, size_t size, std::mt19937_64& rng)
+{
+    std::string open = (rng() % 2 ? "(" : std::string(fuzz_pick(fuzz_unary_functions, rng)) + "(");
+    size_t depth = size / (open.size() + 1);
+    for (size_t i = 0; i < depth; i++)
+        s += open;
+    fuzz_atom(s, rng);
+    s.append(depth, ')');
+}
+
+static void fuzz_shape_arguments(std::string& s, size_t size, std::mt19937_64& rng)
+{
+    s += fuzz_pick(fuzz_variadic_functions, rng);
+    s += '(';
+    fuzz_atom(s, rng);
+    while (s.size() < size) {
+        s += ',';
+        fuzz_atom(s, rng);
+    }
+    s += ')';
+}
+
+static void fuzz_shape_chain(std::string& s, size_t size, std::mt19937_64& rng)
+{
+    fuzz_atom(s, rng);
+    while (s.size() < size) {
+        s += fuzz_pick(fuzz_binary_operators, rng);
+        fuzz_atom(s, rng);
+    }
+}
+
+static void fuzz_shape_ternary(std::string& s, size_t size, std::mt19937_64& rng)
+{
+    while (s.size() < size) {
+        fuzz_atom(s, rng);
+        s += ">0?";
+        fuzz_atom(s, rng);
+        s += ':';
+    }
+    fuzz_atom(s, rng);
+}
+
+static void fuzz_shape_list(std::string& s, size_t size, std::mt19937_64& rng)
+{
+    fuzz_random(s, 32, rng);
+    while (s.size() < size) {
+        s += ',';
+        fuzz_random(s, 32, rng);
+    }
+}
+
+static void fuzz_shape_variables(std::string& s, size_t size, std::mt19937_64& rng)
+{
+    char buf[32];
+    for (size_t i = 0; s.size() < size; i++) {
+        snprintf(buf, sizeof(buf), "%sv%zu", i > 0 ? "+" : "", i + rng() % 4);
+        s += buf;
+    }
+}
+
+static void fuzz_shape_numbers(std::string& s, size_t size, std::mt19937_64& rng)
+{
+    for (size_t i = 0; s.size() < size; i++) {
+        if (i > 0)
+            s += '+';
+        size_t digits = 1 + rng() % 400;
+        for (size_t j = 0; j < digits; j++)
+            s += static_cast<char>('0' + rng() % 10);
+        if (rng() % 2)
+            s += "e-300";
+    }
+}
+
+// Lists of numbers only, which take the huge list fast path
+static void fuzz_shape_literals(std::string& s, size_t size, std::mt19937_64& rng)
+{
+    static const char* functions[] = { "", "sum", "min", "max", "avg", "med", NULL };
+    const char* function = fuzz_pick(functions, rng);
+    s += function;
+    if (*function)
+        s += '(';
+    char buf[32];
+    for (size_t i = 0; s.size() < size; i++) {
+        snprintf(buf, sizeof(buf), "%s%.6g", i > 0 ? "," : "", std::uniform_real_distribution<double>(-1e3, 1e3)(rng));
+        s += buf;
+    }
+    if (*function)
+        s += ')';
+}
+
+// Calls of the mucalc functions with several arguments
+static void fuzz_shape_calls(std::string& s, size_t size, std::mt19937_64& rng)
+{
+    static const char* calls[] = {
+        "beta(a,2)", "clamp(a,0,1)", "smoothstep(0,1,b)", "mix(a,b,0.5)", "step(a,b)",
+        "sobol(7,3)", "halton(11,2,5)", "norminv(0.25)", NULL
+    };
+    for (size_t i = 0; s.size() < size; i++) {
+        if (i > 0)
+            s += fuzz_pick(fuzz_binary_operators, rng);
+        s += fuzz_pick(calls, rng);
+    }
+}
+
+struct FuzzShape
+{
+    const char* name;
+    void (*generate)(std::string& s, size_t size, std::mt19937_64& rng);
+};
+
+static const FuzzShape fuzz_shapes[] = {
+    { "random", fuzz_shape_random },
+    { "nesting", fuzz_shape_nesting },
+    { "arguments", fuzz_shape_arguments },
+    { "chain", fuzz_shape_chain },
+    { "ternary", fuzz_shape_ternary },
+    { "list", fuzz_shape_list },
+    { "variables", fuzz_shape_variables },
+    { "numbers", fuzz_shape_numbers },
+    { "literals", fuzz_shape_literals },
+    { "calls", fuzz_shape_calls },
+};
+
+static void fuzz_print(const char* what, size_t size, const FuzzResult& r)
+{
+    printf("%s: %zu bytes, %.3f ms (%.0f ns/byte), %zu allocations, %zu bytes allocated%s\n",
+            what, size, r.seconds * 1e3, r.seconds * 1e9 / std::max(size, static_cast<size_t>(1)),
+            r.allocations, r.bytes, r.error ? ", error" : "");
+}
+
+static bool fuzz_save(const std::string& file_name, const std::string& expr)
+{
+    FILE* f = fopen(file_name.c_str(), "w");
+    if (!f || fwrite(expr.data(), 1, expr.size(), f) != expr.size() || fputc('\n', f) == EOF) {
+        fprintf(stderr, "Cannot write %s\n", file_name.c_str());
+        if (f)
+            fclose(f);
+        return false;
+    }
+    return (fclose(f) == 0);
+}
+
+static unsigned long fuzz_strtoul(const char* s, const char** end)
+{
+    char* e;
+    unsigned long value = strtoul(s, &e, 10);
+    *end = e;
+    return value;
+}
+
+static double fuzz_strtod(const char* s, const char** end)
+{
+    char* e;
+    double value = strtod(s, &e);
+    *end = e;
+    return value;
+}
+
+int main(int argc, char* argv[])
+{
+    FuzzOptions options;
+    std::vector<std::string> replay_files;
+    // By default, the mucalc-counting binary next to this one
+    std::string dir = argv[0];
+    options.mucalc = (dir.rfind('/') != std::string::npos ? dir.substr(0, dir.rfind('/') + 1) : std::string("./"))
+        + options.mucalc;
+    for (int i = 1; i < argc; i++) {
+        const char* opt = argv[i];
+        const char* arg = (i + 1 < argc ? argv[i + 1] : NULL);
+        const char* end = NULL; // where parsing of the argument stopped
+        if (strcmp(opt, "--help") == 0) {
+            printf("Usage: mucalc-fuzz [<option...>] [<file...>]\n");
+            printf("\n");
+            printf("Generate expressions and report those with super-linear or excessive\n");
+            printf("parse and evaluation cost. With files, measure the expressions in them.\n");
+            printf("\n");
+            printf("Options:\n");
+            printf("  --iterations N       Number of generated input pairs (default 200).\n");
+            printf("  --seed N             Random seed (default: time based).\n");
+            printf("  --max-size N         Size of the larger input of a pair (default 65536).\n");
+            printf("  --max-growth F       Report if time grows F times faster than size (default 2).\n");
+            printf("  --max-ns-per-byte F  Report slower inputs (default 2000).\n");
+            printf("  --max-bytes-per-byte F  Report inputs that allocate more (default 1000).\n");
+            printf("  --output DIR         Store reported inputs in DIR (default .).\n");
+            printf("  --mucalc FILE        The mucalc binary to measure, built with\n");
+            printf("                       MUCALC_COUNT_ALLOCATIONS (default: mucalc-counting\n");
+            printf("                       in the directory of mucalc-fuzz).\n");
+            printf("\n");
+            printf("Reported inputs are listed on standard output. The exit status is only\n");
+            printf("nonzero if an error occurred.\n");
+            return 0;
+        } else if (strcmp(opt, "--iterations") == 0 && arg) {
+            options.iterations = fuzz_strtoul(arg, &end);
+        } else if (strcmp(opt, "--seed") == 0 && arg) {
+            options.seed = fuzz_strtoul(arg, &end);
+        } else if (strcmp(opt, "--max-size") == 0 && arg) {
+            options.max_size = fuzz_strtoul(arg, &end);
+        } else if (strcmp(opt, "--max-growth") == 0 && arg) {
+            options.max_growth = fuzz_strtod(arg, &end);
+        } else if (strcmp(opt, "--max-ns-per-byte") == 0 && arg) {
+            options.max_ns_per_byte = fuzz_strtod(arg, &end);
+        } else if (strcmp(opt, "--max-bytes-per-byte") == 0 && arg) {
+            options.max_bytes_per_byte = fuzz_strtod(arg, &end);
+        } else if (strcmp(opt, "--output") == 0 && arg) {
+            options.output_dir = arg;
+            end = arg + strlen(arg);
+        } else if (strcmp(opt, "--mucalc") == 0 && arg) {
+            options.mucalc = arg;
+            end = arg + strlen(arg);
+        } else if (strncmp(opt, "--", 2) == 0) {
+            fprintf(stderr, "Invalid option %s\n", opt);
+            return 1;
+        } else {
+            replay_files.push_back(opt);
+            continue;
+        }
+        if (!end || *end != '\0') {
+            fprintf(stderr, "Invalid argument for %s: %s\n", opt, arg);
+            return 1;
+        }
+        i++;
+    }
+
+    // Measure given inputs
+    if (!replay_files.empty()) {
+        int retval = 0;
+        for (size_t i = 0; i < replay_files.size(); i++) {
+            FILE* f = fopen(replay_files[i].c_str(), "r");
+            if (!f) {
+                fprintf(stderr, "Cannot open %s\n", replay_files[i].c_str());
+                retval = 1;
+                continue;
+            }
+            std::string expr;
+            char buf[4096];
+            size_t n;
+            while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+                expr.append(buf, n);
+            fclose(f);
+            while (!expr.empty() && expr.back() == '\n')
+                expr.pop_back();
+            FuzzResult r;
+            if (!fuzz_measure(options, expr, r))
+                return 1;
+            fuzz_print(replay_files[i].c_str(), expr.size(), r);
+        }
+        return retval;
+    }
+
+    // Generate pairs of inputs of the same shape that differ in size by a
+    // factor of four, and compare their costs
+    if (options.seed == 0)
+        options.seed = std::chrono::system_clock::now().time_since_epoch().count();
+    printf("Seed %lu\n", options.seed);
+    std::mt19937_64 rng(options.seed);
+    const size_t shapes = sizeof(fuzz_shapes) / sizeof(fuzz_shapes[0]);
+    const size_t growth = 4;
+    size_t reported = 0;
+    for (size_t i = 0; i < options.iterations; i++) {
+        const FuzzShape& shape = fuzz_shapes[i % shapes];
+        size_t size = std::uniform_int_distribution<size_t>(
+                options.max_size / (4 * growth), options.max_size / growth)(rng);
+        unsigned long input_seed = rng();
+        std::string small, large;
+        std::mt19937_64 small_rng(input_seed), large_rng(input_seed);
+        shape.generate(small, size, small_rng);
+        shape.generate(large, size * growth, large_rng);
+        FuzzResult rs, rl;
+        if (!fuzz_measure(options, small, rs) || !fuzz_measure(options, large, rl))
+            return 1;
+
+        std::string reason;
+        double size_growth = static_cast<double>(large.size()) / small.size();
+        double time_growth = rl.seconds / std::max(rs.seconds, 1e-9);
+        if (rl.seconds >= options.min_seconds && time_growth > options.max_growth * size_growth)
+            reason = "super-linear time";
+        else if (rl.seconds >= options.min_seconds && rl.seconds * 1e9 / large.size() > options.max_ns_per_byte)
+            reason = "slow";
+        else if (static_cast<double>(rl.bytes) / large.size() > options.max_bytes_per_byte)
+            reason = "memory";
+        if (reason.empty())
+            continue;
+
+        char file_name[64];
+        snprintf(file_name, sizeof(file_name), "%s-%zu-%lu.txt", shape.name, large.size(), input_seed);
+        std::string path = options.output_dir + "/" + file_name;
+        printf("%s input (%s, time x%.1f for size x%.1f), stored as %s\n",
+                shape.name, reason.c_str(), time_growth, size_growth, path.c_str());
+        fuzz_print("  smaller", small.size(), rs);
+        fuzz_print("  larger", large.size(), rl);
+        fflush(stdout);
+        if (!fuzz_save(path, large))
+            return 1;
+        reported++;
+    }
+    printf("%zu of %zu inputs reported\n", reported, options.iterations);
+    return 0;
+}
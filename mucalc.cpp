@@ -21,6 +21,10 @@
 #include <cstring>
 #include <cmath>
 #include <cerrno>
+#include <cstdint>
+#include <climits>
+#include <cfloat>
+#include <cfenv>
 
 #include <vector>
 #include <memory>
@@ -30,301 +34,5696 @@
 #include <string>
 #include <random>
 #include <chrono>
+#include <deque>
+#include <map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <new>
 
 #include <unistd.h>
+#if !(defined(_WIN32) || defined(_WIN64))
+# include <sys/select.h>
+# include <fcntl.h>
+#endif
+#ifdef __linux__
+# include <sched.h>
+# include <pthread.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
 
 #include <readline/readline.h>
 #include <readline/history.h>
 
 #include <muParser.h>
 
+#include "mucalc.hpp"
+
+
+/* memory-mapped files */
+
+// A file that is mapped into memory, either read-only, or as a private
+// copy-on-write mapping whose changes are not written back, or created for
+// writing with a given size. Without mmap() support, the contents are read
+// into memory instead, and written to the file by close(). Errors are
+// reported on stderr.
+class MappedFile
+{
+private:
+    std::string _name;
+    char* _data;
+    size_t _size;
+    bool _writable;
+
+    bool fail()
+    {
+        fprintf(stderr, "%s: %s\n", _name.c_str(), strerror(errno));
+        return false;
+    }
+
+public:
+    MappedFile() : _data(NULL), _size(0), _writable(false)
+    {
+    }
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    bool open(const std::string& name, bool private_copy = false)
+    {
+        close();
+        _name = name;
+        _writable = false;
+#ifdef __linux__
+        int fd = ::open(name.c_str(), O_RDONLY);
+        if (fd < 0)
+            return fail();
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return fail();
+        }
+        _size = st.st_size;
+        if (_size > 0) {
+            void* p = (private_copy
+                    ? mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)
+                    : mmap(NULL, _size, PROT_READ, MAP_SHARED, fd, 0));
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                _size = 0;
+                return fail();
+            }
+            _data = static_cast<char*>(p);
+        }
+        ::close(fd);
+#else
+        (void)private_copy;
+        FILE* f = fopen(name.c_str(), "rb");
+        if (!f)
+            return fail();
+        std::vector<char> buffer;
+        char chunk[65536];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+            buffer.insert(buffer.end(), chunk, chunk + n);
+        bool ok = !ferror(f);
+        fclose(f);
+        if (!ok)
+            return fail();
+        _size = buffer.size();
+        _data = static_cast<char*>(malloc(std::max(_size, static_cast<size_t>(1))));
+        if (!_data)
+            throw std::bad_alloc();
+        memcpy(_data, buffer.data(), _size);
+#endif
+        return true;
+    }
+
+    bool create(const std::string& name, size_t size)
+    {
+        close();
+        _name = name;
+        _writable = true;
+        _size = size;
+#ifdef __linux__
+        int fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0)
+            return fail();
+        if (ftruncate(fd, size) != 0) {
+            ::close(fd);
+            return fail();
+        }
+        if (size > 0) {
+            void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                return fail();
+            }
+            _data = static_cast<char*>(p);
+        }
+        ::close(fd);
+#else
+        _data = static_cast<char*>(calloc(std::max(size, static_cast<size_t>(1)), 1));
+        if (!_data)
+            throw std::bad_alloc();
+#endif
+        return true;
+    }
+
+    // Unmap the file; returns false if writing the contents failed
+    bool close()
+    {
+        bool ok = true;
+        if (!_data)
+            return ok;
+#ifdef __linux__
+        munmap(_data, _size);
+#else
+        if (_writable) {
+            FILE* f = fopen(_name.c_str(), "wb");
+            ok = f && fwrite(_data, 1, _size, f) == _size;
+            ok = f && (fclose(f) == 0) && ok;
+            if (!ok)
+                fail();
+        }
+        free(_data);
+#endif
+        _data = NULL;
+        _size = 0;
+        return ok;
+    }
+
+    const std::string& name() const
+    {
+        return _name;
+    }
+
+    char* data() const
+    {
+        return _data;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+};
+
+/* muparser custom functions */
+
+// The constants, the % operator, and most custom functions are shared with
+// C++ code through mucalc.hpp.
+
+static double unary_plus(double x)
+{
+    return x;
+}
+
+// each evaluation thread has its own generator
+static thread_local std::mt19937_64 prng;
+static thread_local std::uniform_real_distribution<double> uniform_distrib(0.0, 1.0);
+static thread_local std::normal_distribution<double> gaussian_distrib(0.0, 1.0);
+
+// Standard exponential numbers are generated with the ziggurat method of
+// Marsaglia and Tsang, a block at a time
+class ExponentialSampler
+{
+private:
+    uint32_t _k[256];
+    double _w[256];
+    double _f[256];
+    double _block[256];
+    int _next;
+
+    double sample()
+    {
+        for (;;) {
+            // the layer index and the value use independent bits
+            uint64_t bits = prng();
+            int i = bits & 255;
+            uint32_t j = bits >> 32;
+            double x = j * _w[i];
+            if (j < _k[i])
+                return x;
+            if (i == 0)
+                return 7.69711747013104972 - std::log(1.0 - uniform_distrib(prng));
+            if (_f[i] + uniform_distrib(prng) * (_f[i - 1] - _f[i]) < std::exp(-x))
+                return x;
+        }
+    }
+
+public:
+    ExponentialSampler() : _next(256)
+    {
+        const double m = 4294967296.0;
+        const double v = 3.9496598225815571993e-3;
+        double d = 7.69711747013104972;
+        double t = d;
+        double q = v / std::exp(-d);
+        _k[0] = (d / q) * m;
+        _k[1] = 0;
+        _w[0] = q / m;
+        _w[255] = d / m;
+        _f[0] = 1.0;
+        _f[255] = std::exp(-d);
+        for (int i = 254; i >= 1; i--) {
+            d = -std::log(v / d + std::exp(-d));
+            _k[i + 1] = (d / t) * m;
+            t = d;
+            _f[i] = std::exp(-d);
+            _w[i] = d / m;
+        }
+    }
+
+    void reset()
+    {
+        _next = 256;
+    }
+
+    double next()
+    {
+        if (_next == 256) {
+            for (int i = 0; i < 256; i++)
+                _block[i] = sample();
+            _next = 0;
+        }
+        return _block[_next++];
+    }
+};
+
+static thread_local ExponentialSampler exponential_sampler;
+
+// Distributions with parameters keep their setup while the parameters stay
+// the same, which is the common case in simulations
+static thread_local std::poisson_distribution<long> poisson_distrib;
+static thread_local std::binomial_distribution<long> binomial_distrib;
+static thread_local std::gamma_distribution<double> gamma_distrib;
+
+// Weighted discrete distribution with the alias method of Walker and Vose
+struct AliasTable
+{
+    std::vector<double> weights;
+    std::vector<double> probability;
+    std::vector<int> alias;
+
+    bool setup(const double* w, int n)
+    {
+        if (weights.size() == static_cast<size_t>(n) && std::equal(weights.begin(), weights.end(), w))
+            return !probability.empty();
+        weights.assign(w, w + n);
+        probability.clear();
+        double sum = 0.0;
+        for (int i = 0; i < n; i++) {
+            if (!(w[i] >= 0.0) || std::isinf(w[i]))
+                return false;
+            sum += w[i];
+        }
+        if (!(sum > 0.0))
+            return false;
+        probability.resize(n);
+        alias.assign(n, 0);
+        std::vector<int> small, large;
+        for (int i = 0; i < n; i++) {
+            probability[i] = w[i] * n / sum;
+            (probability[i] < 1.0 ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            int s = small.back();
+            int l = large.back();
+            small.pop_back();
+            alias[s] = l;
+            probability[l] -= 1.0 - probability[s];
+            if (probability[l] < 1.0) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // what remains is 1 up to rounding errors
+        for (size_t i = 0; i < small.size(); i++)
+            probability[small[i]] = 1.0;
+        for (size_t i = 0; i < large.size(); i++)
+            probability[large[i]] = 1.0;
+        return true;
+    }
+
+    double sample()
+    {
+        double u = uniform_distrib(prng) * probability.size();
+        size_t i = std::min(static_cast<size_t>(u), probability.size() - 1);
+        return (u - i < probability[i] ? i : alias[i]);
+    }
+};
+
+static thread_local AliasTable alias_table;
+
+static double seed(double x)
+{
+    prng.seed(x);
+    gaussian_distrib.reset();
+    exponential_sampler.reset();
+    poisson_distrib.reset();
+    binomial_distrib.reset();
+    gamma_distrib.reset();
+    return 0.0;
+}
+
+static double random_()
+{
+    return uniform_distrib(prng);
+}
+
+static double gaussian()
+{
+    return gaussian_distrib(prng);
+}
+
+static double exponential(double lambda)
+{
+    if (!(lambda > 0.0))
+        return NAN;
+    return exponential_sampler.next() / lambda;
+}
+
+static double poisson(double lambda)
+{
+    if (!(lambda > 0.0) || std::isinf(lambda))
+        return NAN;
+    if (poisson_distrib.mean() != lambda)
+        poisson_distrib.param(std::poisson_distribution<long>::param_type(lambda));
+    return poisson_distrib(prng);
+}
+
+static double binomial(double n, double p)
+{
+    if (!(n >= 0.0 && n <= 1e15 && n == std::floor(n) && p >= 0.0 && p <= 1.0))
+        return NAN;
+    if (binomial_distrib.t() != n || binomial_distrib.p() != p)
+        binomial_distrib.param(std::binomial_distribution<long>::param_type(n, p));
+    return binomial_distrib(prng);
+}
+
+static double gamma_(double k, double theta)
+{
+    if (!(k > 0.0 && theta > 0.0) || std::isinf(k) || std::isinf(theta))
+        return NAN;
+    if (gamma_distrib.alpha() != k || gamma_distrib.beta() != theta)
+        gamma_distrib.param(std::gamma_distribution<double>::param_type(k, theta));
+    return gamma_distrib(prng);
+}
+
+// Returns the index of the chosen weight
+static double discrete(const double* w, int n)
+{
+    if (!alias_table.setup(w, n))
+        return NAN;
+    return alias_table.sample();
+}
+
+// Quasi-random low-discrepancy sequences. sobol(i, dim) and halton(i, dim)
+// return coordinate dim (starting at 1) of point i (starting at 0). They
+// depend on their arguments only, so points can be computed in any order and
+// on any thread. An optional third argument is a seed for scrambling: random
+// linear matrix scrambling with a digital shift for Sobol, and random digit
+// permutations for Halton.
+
+// Primitive polynomials (degree s, coefficients a) and initial direction
+// numbers m for dimensions 2 and up, from the new-joe-kuo-6.21201 table by
+// S. Joe and F. Y. Kuo
+struct SobolInit
+{
+    int s;
+    int a;
+    unsigned int m[11];
+};
+
+static const SobolInit sobol_init[] = {
+    { 1, 0, { 1 } }, { 2, 1, { 1, 3 } }, { 3, 1, { 1, 3, 1 } }, { 3, 2, { 1, 1, 1 } },
+    { 4, 1, { 1, 1, 3, 3 } }, { 4, 4, { 1, 3, 5, 13 } }, { 5, 2, { 1, 1, 5, 5, 17 } },
+    { 5, 4, { 1, 1, 5, 5, 5 } }, { 5, 7, { 1, 1, 7, 11, 19 } }, { 5, 11, { 1, 1, 5, 1, 1 } },
+    { 5, 13, { 1, 1, 1, 3, 11 } }, { 5, 14, { 1, 3, 5, 5, 31 } }, { 6, 1, { 1, 3, 3, 9, 7, 49 } },
+    { 6, 13, { 1, 1, 1, 15, 21, 21 } }, { 6, 16, { 1, 3, 1, 13, 27, 49 } },
+    { 6, 19, { 1, 1, 1, 15, 7, 5 } }, { 6, 22, { 1, 3, 1, 15, 13, 25 } },
+    { 6, 25, { 1, 1, 5, 5, 19, 61 } }, { 7, 1, { 1, 3, 7, 11, 23, 15, 103 } },
+    { 7, 4, { 1, 3, 7, 13, 13, 15, 69 } }, { 7, 7, { 1, 1, 3, 13, 7, 35, 63 } },
+    { 7, 8, { 1, 3, 5, 9, 1, 25, 53 } }, { 7, 14, { 1, 3, 1, 13, 9, 35, 107 } },
+    { 7, 19, { 1, 3, 1, 5, 27, 61, 31 } }, { 7, 21, { 1, 1, 5, 11, 19, 41, 61 } },
+    { 7, 28, { 1, 3, 5, 3, 3, 13, 69 } }, { 7, 31, { 1, 1, 7, 13, 1, 19, 1 } },
+    { 7, 32, { 1, 3, 7, 5, 13, 19, 59 } }, { 7, 37, { 1, 1, 3, 9, 25, 29, 41 } },
+    { 7, 41, { 1, 3, 5, 13, 23, 1, 55 } }, { 7, 42, { 1, 3, 7, 3, 13, 59, 17 } },
+    { 7, 50, { 1, 3, 1, 3, 5, 53, 69 } }, { 7, 55, { 1, 1, 5, 5, 23, 33, 13 } },
+    { 7, 56, { 1, 1, 7, 7, 1, 61, 123 } }, { 7, 59, { 1, 1, 7, 9, 13, 61, 49 } },
+    { 7, 62, { 1, 3, 3, 5, 3, 55, 33 } }, { 8, 14, { 1, 3, 1, 15, 31, 13, 49, 245 } },
+    { 8, 21, { 1, 3, 5, 15, 31, 59, 63, 97 } }, { 8, 22, { 1, 3, 1, 11, 11, 11, 77, 249 } },
+    { 8, 38, { 1, 3, 1, 11, 27, 43, 71, 9 } }, { 8, 47, { 1, 1, 7, 15, 21, 11, 81, 45 } },
+    { 8, 49, { 1, 3, 7, 3, 25, 31, 65, 79 } }, { 8, 50, { 1, 3, 1, 1, 19, 11, 3, 205 } },
+    { 8, 52, { 1, 1, 5, 9, 19, 21, 29, 157 } }, { 8, 56, { 1, 3, 7, 11, 1, 33, 89, 185 } },
+    { 8, 67, { 1, 3, 3, 3, 15, 9, 79, 71 } }, { 8, 70, { 1, 3, 7, 11, 15, 39, 119, 27 } },
+    { 8, 84, { 1, 1, 3, 1, 11, 31, 97, 225 } }, { 8, 97, { 1, 1, 1, 3, 23, 43, 57, 177 } },
+    { 8, 103, { 1, 3, 7, 7, 17, 17, 37, 71 } }, { 8, 115, { 1, 3, 1, 5, 27, 63, 123, 213 } },
+    { 8, 122, { 1, 1, 3, 5, 11, 43, 53, 133 } }, { 9, 8, { 1, 3, 5, 5, 29, 17, 47, 173, 479 } },
+    { 9, 13, { 1, 3, 3, 11, 3, 1, 109, 9, 69 } }, { 9, 16, { 1, 1, 1, 5, 17, 39, 23, 5, 343 } },
+    { 9, 22, { 1, 3, 1, 5, 25, 15, 31, 103, 499 } },
+    { 9, 25, { 1, 1, 1, 11, 11, 17, 63, 105, 183 } },
+    { 9, 44, { 1, 1, 5, 11, 9, 29, 97, 231, 363 } },
+    { 9, 47, { 1, 1, 5, 15, 19, 45, 41, 7, 383 } },
+    { 9, 52, { 1, 3, 7, 7, 31, 19, 83, 137, 221 } },
+    { 9, 55, { 1, 1, 1, 3, 23, 15, 111, 223, 83 } },
+    { 9, 59, { 1, 1, 5, 13, 31, 15, 55, 25, 161 } },
+    { 9, 62, { 1, 1, 3, 13, 25, 47, 39, 87, 257 } },
+    { 9, 67, { 1, 1, 1, 11, 21, 53, 125, 249, 293 } },
+    { 9, 74, { 1, 1, 7, 11, 11, 7, 57, 79, 323 } }, { 9, 81, { 1, 1, 5, 5, 17, 13, 81, 3, 131 } },
+    { 9, 82, { 1, 1, 7, 13, 23, 7, 65, 251, 475 } }, { 9, 87, { 1, 3, 5, 1, 9, 43, 3, 149, 11 } },
+    { 9, 91, { 1, 1, 3, 13, 31, 13, 13, 255, 487 } },
+    { 9, 94, { 1, 3, 3, 1, 5, 63, 89, 91, 127 } },
+    { 9, 103, { 1, 1, 3, 3, 1, 19, 123, 127, 237 } },
+    { 9, 104, { 1, 1, 5, 7, 23, 31, 37, 243, 289 } },
+    { 9, 109, { 1, 1, 5, 11, 17, 53, 117, 183, 491 } },
+    { 9, 122, { 1, 1, 1, 5, 1, 13, 13, 209, 345 } },
+    { 9, 124, { 1, 1, 3, 15, 1, 57, 115, 7, 33 } },
+    { 9, 137, { 1, 3, 1, 11, 7, 43, 81, 207, 175 } },
+    { 9, 138, { 1, 3, 1, 1, 15, 27, 63, 255, 49 } },
+    { 9, 143, { 1, 3, 5, 3, 27, 61, 105, 171, 305 } },
+    { 9, 145, { 1, 1, 5, 3, 1, 3, 57, 249, 149 } }, { 9, 152, { 1, 1, 3, 5, 5, 57, 15, 13, 159 } },
+    { 9, 157, { 1, 1, 1, 11, 7, 11, 105, 141, 225 } },
+    { 9, 167, { 1, 3, 3, 5, 27, 59, 121, 101, 271 } },
+    { 9, 173, { 1, 3, 5, 9, 11, 49, 51, 59, 115 } },
+    { 9, 176, { 1, 1, 7, 1, 23, 45, 125, 71, 419 } },
+    { 9, 181, { 1, 1, 3, 5, 23, 5, 105, 109, 75 } },
+    { 9, 182, { 1, 1, 7, 15, 7, 11, 67, 121, 453 } },
+    { 9, 185, { 1, 3, 7, 3, 9, 13, 31, 27, 449 } },
+    { 9, 191, { 1, 3, 1, 15, 19, 39, 39, 89, 15 } },
+    { 9, 194, { 1, 1, 1, 1, 1, 33, 73, 145, 379 } },
+    { 9, 199, { 1, 3, 1, 15, 15, 43, 29, 13, 483 } },
+    { 9, 218, { 1, 1, 7, 3, 19, 27, 85, 131, 431 } },
+    { 9, 220, { 1, 3, 3, 3, 5, 35, 23, 195, 349 } },
+    { 9, 227, { 1, 3, 3, 7, 9, 27, 39, 59, 297 } },
+    { 9, 229, { 1, 1, 3, 9, 11, 17, 13, 241, 157 } },
+    { 9, 230, { 1, 3, 7, 15, 25, 57, 33, 189, 213 } },
+    { 9, 234, { 1, 1, 7, 1, 9, 55, 73, 83, 217 } },
+    { 9, 236, { 1, 3, 3, 13, 19, 27, 23, 113, 249 } },
+    { 9, 241, { 1, 3, 5, 3, 23, 43, 3, 253, 479 } },
+    { 9, 244, { 1, 1, 5, 5, 11, 5, 45, 117, 217 } },
+    { 9, 253, { 1, 3, 3, 7, 29, 37, 33, 123, 147 } },
+    { 10, 4, { 1, 3, 1, 15, 5, 5, 37, 227, 223, 459 } },
+    { 10, 13, { 1, 1, 7, 5, 5, 39, 63, 255, 135, 487 } },
+    { 10, 19, { 1, 3, 1, 7, 9, 7, 87, 249, 217, 599 } },
+    { 10, 22, { 1, 1, 3, 13, 9, 47, 7, 225, 363, 247 } },
+    { 10, 50, { 1, 3, 7, 13, 19, 13, 9, 67, 9, 737 } },
+    { 10, 55, { 1, 3, 5, 5, 19, 59, 7, 41, 319, 677 } },
+    { 10, 64, { 1, 1, 5, 3, 31, 63, 15, 43, 207, 789 } },
+    { 10, 69, { 1, 1, 7, 9, 13, 39, 3, 47, 497, 169 } },
+    { 10, 98, { 1, 3, 1, 7, 21, 17, 97, 19, 415, 905 } },
+    { 10, 107, { 1, 3, 7, 1, 3, 31, 71, 111, 165, 127 } },
+    { 10, 115, { 1, 1, 5, 11, 1, 61, 83, 119, 203, 847 } },
+    { 10, 121, { 1, 3, 3, 13, 9, 61, 19, 97, 47, 35 } },
+    { 10, 127, { 1, 1, 7, 7, 15, 29, 63, 95, 417, 469 } },
+    { 10, 134, { 1, 3, 1, 9, 25, 9, 71, 57, 213, 385 } },
+    { 10, 140, { 1, 3, 5, 13, 31, 47, 101, 57, 39, 341 } },
+    { 10, 145, { 1, 1, 3, 3, 31, 57, 125, 173, 365, 551 } },
+    { 10, 152, { 1, 3, 7, 1, 13, 57, 67, 157, 451, 707 } },
+    { 10, 158, { 1, 1, 1, 7, 21, 13, 105, 89, 429, 965 } },
+    { 10, 161, { 1, 1, 5, 9, 17, 51, 45, 119, 157, 141 } },
+    { 10, 171, { 1, 3, 7, 7, 13, 45, 91, 9, 129, 741 } },
+    { 10, 181, { 1, 3, 7, 1, 23, 57, 67, 141, 151, 571 } },
+    { 10, 194, { 1, 1, 3, 11, 17, 47, 93, 107, 375, 157 } },
+    { 10, 199, { 1, 3, 3, 5, 11, 21, 43, 51, 169, 915 } },
+    { 10, 203, { 1, 1, 5, 3, 15, 55, 101, 67, 455, 625 } },
+    { 10, 208, { 1, 3, 5, 9, 1, 23, 29, 47, 345, 595 } },
+    { 10, 227, { 1, 3, 7, 7, 5, 49, 29, 155, 323, 589 } },
+    { 10, 242, { 1, 3, 3, 7, 5, 41, 127, 61, 261, 717 } },
+    { 10, 251, { 1, 3, 7, 7, 17, 23, 117, 67, 129, 1009 } },
+    { 10, 253, { 1, 1, 3, 13, 11, 39, 21, 207, 123, 305 } },
+    { 10, 265, { 1, 1, 3, 9, 29, 3, 95, 47, 231, 73 } },
+    { 10, 266, { 1, 3, 1, 9, 1, 29, 117, 21, 441, 259 } },
+    { 10, 274, { 1, 3, 1, 13, 21, 39, 125, 211, 439, 723 } },
+    { 10, 283, { 1, 1, 7, 3, 17, 63, 115, 89, 49, 773 } },
+    { 10, 289, { 1, 3, 7, 13, 11, 33, 101, 107, 63, 73 } },
+    { 10, 295, { 1, 1, 5, 5, 13, 57, 63, 135, 437, 177 } },
+    { 10, 301, { 1, 1, 3, 7, 27, 63, 93, 47, 417, 483 } },
+    { 10, 316, { 1, 1, 3, 1, 23, 29, 1, 191, 49, 23 } },
+    { 10, 319, { 1, 1, 3, 15, 25, 55, 9, 101, 219, 607 } },
+    { 10, 324, { 1, 3, 1, 7, 7, 19, 51, 251, 393, 307 } },
+    { 10, 346, { 1, 3, 3, 3, 25, 55, 17, 75, 337, 3 } },
+    { 10, 352, { 1, 1, 1, 13, 25, 17, 65, 45, 479, 413 } },
+    { 10, 361, { 1, 1, 7, 7, 27, 49, 99, 161, 213, 727 } },
+    { 10, 367, { 1, 3, 5, 1, 23, 5, 43, 41, 251, 857 } },
+    { 10, 382, { 1, 3, 3, 7, 11, 61, 39, 87, 383, 835 } },
+    { 10, 395, { 1, 1, 3, 15, 13, 7, 29, 7, 505, 923 } },
+    { 10, 398, { 1, 3, 7, 1, 5, 31, 47, 157, 445, 501 } },
+    { 10, 400, { 1, 1, 3, 7, 1, 43, 9, 147, 115, 605 } },
+    { 10, 412, { 1, 3, 3, 13, 5, 1, 119, 211, 455, 1001 } },
+    { 10, 419, { 1, 1, 3, 5, 13, 19, 3, 243, 75, 843 } },
+    { 10, 422, { 1, 3, 7, 7, 1, 19, 91, 249, 357, 589 } },
+    { 10, 426, { 1, 1, 1, 9, 1, 25, 109, 197, 279, 411 } },
+    { 10, 428, { 1, 3, 1, 15, 23, 57, 59, 135, 191, 75 } },
+    { 10, 433, { 1, 1, 5, 15, 29, 21, 39, 253, 383, 349 } },
+    { 10, 446, { 1, 3, 3, 5, 19, 45, 61, 151, 199, 981 } },
+    { 10, 454, { 1, 3, 5, 13, 9, 61, 107, 141, 141, 1 } },
+    { 10, 457, { 1, 3, 1, 11, 27, 25, 85, 105, 309, 979 } },
+    { 10, 472, { 1, 3, 3, 11, 19, 7, 115, 223, 349, 43 } },
+    { 10, 493, { 1, 1, 7, 9, 21, 39, 123, 21, 275, 927 } },
+    { 10, 505, { 1, 1, 7, 13, 15, 41, 47, 243, 303, 437 } },
+    { 10, 508, { 1, 1, 1, 7, 7, 3, 15, 99, 409, 719 } },
+    { 11, 2, { 1, 3, 3, 15, 27, 49, 113, 123, 113, 67, 469 } },
+    { 11, 11, { 1, 3, 7, 11, 3, 23, 87, 169, 119, 483, 199 } },
+    { 11, 21, { 1, 1, 5, 15, 7, 17, 109, 229, 179, 213, 741 } },
+    { 11, 22, { 1, 1, 5, 13, 11, 17, 25, 135, 403, 557, 1433 } },
+    { 11, 35, { 1, 3, 1, 1, 1, 61, 67, 215, 189, 945, 1243 } },
+    { 11, 49, { 1, 1, 7, 13, 17, 33, 9, 221, 429, 217, 1679 } },
+    { 11, 50, { 1, 1, 3, 11, 27, 3, 15, 93, 93, 865, 1049 } },
+    { 11, 56, { 1, 3, 7, 7, 25, 41, 121, 35, 373, 379, 1547 } },
+    { 11, 61, { 1, 3, 3, 9, 11, 35, 45, 205, 241, 9, 59 } },
+    { 11, 70, { 1, 3, 1, 7, 3, 51, 7, 177, 53, 975, 89 } },
+    { 11, 74, { 1, 1, 3, 5, 27, 1, 113, 231, 299, 759, 861 } },
+    { 11, 79, { 1, 3, 3, 15, 25, 29, 5, 255, 139, 891, 2031 } },
+    { 11, 84, { 1, 3, 1, 1, 13, 9, 109, 193, 419, 95, 17 } },
+    { 11, 88, { 1, 1, 7, 9, 3, 7, 29, 41, 135, 839, 867 } },
+    { 11, 103, { 1, 1, 7, 9, 25, 49, 123, 217, 113, 909, 215 } },
+    { 11, 104, { 1, 1, 7, 3, 23, 15, 43, 133, 217, 327, 901 } },
+    { 11, 112, { 1, 1, 3, 3, 13, 53, 63, 123, 477, 711, 1387 } },
+    { 11, 115, { 1, 1, 3, 15, 7, 29, 75, 119, 181, 957, 247 } },
+    { 11, 117, { 1, 1, 1, 11, 27, 25, 109, 151, 267, 99, 1461 } },
+    { 11, 122, { 1, 3, 7, 15, 5, 5, 53, 145, 11, 725, 1501 } },
+    { 11, 134, { 1, 3, 7, 1, 9, 43, 71, 229, 157, 607, 1835 } },
+    { 11, 137, { 1, 3, 3, 13, 25, 1, 5, 27, 471, 349, 127 } },
+    { 11, 146, { 1, 1, 1, 1, 23, 37, 9, 221, 269, 897, 1685 } },
+    { 11, 148, { 1, 1, 3, 3, 31, 29, 51, 19, 311, 553, 1969 } },
+    { 11, 157, { 1, 3, 7, 5, 5, 55, 17, 39, 475, 671, 1529 } },
+    { 11, 158, { 1, 1, 7, 1, 1, 35, 47, 27, 437, 395, 1635 } },
+    { 11, 162, { 1, 1, 7, 3, 13, 23, 43, 135, 327, 139, 389 } },
+    { 11, 164, { 1, 3, 7, 3, 9, 25, 91, 25, 429, 219, 513 } },
+    { 11, 168, { 1, 1, 3, 5, 13, 29, 119, 201, 277, 157, 2043 } },
+    { 11, 173, { 1, 3, 5, 3, 29, 57, 13, 17, 167, 739, 1031 } },
+    { 11, 185, { 1, 3, 3, 5, 29, 21, 95, 27, 255, 679, 1531 } },
+    { 11, 186, { 1, 3, 7, 15, 9, 5, 21, 71, 61, 961, 1201 } },
+    { 11, 191, { 1, 3, 5, 13, 15, 57, 33, 93, 459, 867, 223 } },
+    { 11, 193, { 1, 1, 1, 15, 17, 43, 127, 191, 67, 177, 1073 } },
+    { 11, 199, { 1, 1, 1, 15, 23, 7, 21, 199, 75, 293, 1611 } },
+    { 11, 213, { 1, 3, 7, 13, 15, 39, 21, 149, 65, 741, 319 } },
+    { 11, 214, { 1, 3, 7, 11, 23, 13, 101, 89, 277, 519, 711 } },
+    { 11, 220, { 1, 3, 7, 15, 19, 27, 85, 203, 441, 97, 1895 } },
+    { 11, 227, { 1, 3, 1, 3, 29, 25, 21, 155, 11, 191, 197 } },
+    { 11, 236, { 1, 1, 7, 5, 27, 11, 81, 101, 457, 675, 1687 } },
+    { 11, 242, { 1, 3, 1, 5, 25, 5, 65, 193, 41, 567, 781 } },
+    { 11, 251, { 1, 3, 1, 5, 11, 15, 113, 77, 411, 695, 1111 } },
+    { 11, 256, { 1, 1, 3, 9, 11, 53, 119, 171, 55, 297, 509 } },
+    { 11, 259, { 1, 1, 1, 1, 11, 39, 113, 139, 165, 347, 595 } },
+    { 11, 265, { 1, 3, 7, 11, 9, 17, 101, 13, 81, 325, 1733 } },
+    { 11, 266, { 1, 3, 1, 1, 21, 43, 115, 9, 113, 907, 645 } },
+    { 11, 276, { 1, 1, 7, 3, 9, 25, 117, 197, 159, 471, 475 } },
+    { 11, 292, { 1, 3, 1, 9, 11, 21, 57, 207, 485, 613, 1661 } },
+    { 11, 304, { 1, 1, 7, 7, 27, 55, 49, 223, 89, 85, 1523 } },
+    { 11, 310, { 1, 1, 5, 3, 19, 41, 45, 51, 447, 299, 1355 } },
+    { 11, 316, { 1, 3, 1, 13, 1, 33, 117, 143, 313, 187, 1073 } },
+    { 11, 319, { 1, 1, 7, 7, 5, 11, 65, 97, 377, 377, 1501 } },
+    { 11, 322, { 1, 3, 1, 1, 21, 35, 95, 65, 99, 23, 1239 } },
+    { 11, 328, { 1, 1, 5, 9, 3, 37, 95, 167, 115, 425, 867 } },
+    { 11, 334, { 1, 3, 3, 13, 1, 37, 27, 189, 81, 679, 773 } },
+    { 11, 339, { 1, 1, 3, 11, 1, 61, 99, 233, 429, 969, 49 } },
+    { 11, 341, { 1, 1, 1, 7, 25, 63, 99, 165, 245, 793, 1143 } },
+    { 11, 345, { 1, 1, 5, 11, 11, 43, 55, 65, 71, 283, 273 } },
+    { 11, 346, { 1, 1, 5, 5, 9, 3, 101, 251, 355, 379, 1611 } },
+    { 11, 362, { 1, 1, 1, 15, 21, 63, 85, 99, 49, 749, 1335 } },
+    { 11, 367, { 1, 1, 5, 13, 27, 9, 121, 43, 255, 715, 289 } },
+    { 11, 372, { 1, 3, 1, 5, 27, 19, 17, 223, 77, 571, 1415 } },
+    { 11, 375, { 1, 1, 5, 3, 13, 59, 125, 251, 195, 551, 1737 } },
+    { 11, 376, { 1, 3, 3, 15, 13, 27, 49, 105, 389, 971, 755 } },
+    { 11, 381, { 1, 3, 5, 15, 23, 43, 35, 107, 447, 763, 253 } },
+    { 11, 385, { 1, 3, 5, 11, 21, 3, 17, 39, 497, 407, 611 } },
+    { 11, 388, { 1, 1, 7, 13, 15, 31, 113, 17, 23, 507, 1995 } },
+    { 11, 392, { 1, 1, 7, 15, 3, 15, 31, 153, 423, 79, 503 } },
+    { 11, 409, { 1, 1, 7, 9, 19, 25, 23, 171, 505, 923, 1989 } },
+    { 11, 415, { 1, 1, 5, 9, 21, 27, 121, 223, 133, 87, 697 } },
+    { 11, 416, { 1, 1, 5, 5, 9, 19, 107, 99, 319, 765, 1461 } },
+    { 11, 421, { 1, 1, 3, 3, 19, 25, 3, 101, 171, 729, 187 } },
+    { 11, 428, { 1, 1, 3, 1, 13, 23, 85, 93, 291, 209, 37 } },
+    { 11, 431, { 1, 1, 1, 15, 25, 25, 77, 253, 333, 947, 1073 } },
+    { 11, 434, { 1, 1, 3, 9, 17, 29, 55, 47, 255, 305, 2037 } },
+    { 11, 439, { 1, 3, 3, 9, 29, 63, 9, 103, 489, 939, 1523 } },
+    { 11, 446, { 1, 3, 7, 15, 7, 31, 89, 175, 369, 339, 595 } },
+    { 11, 451, { 1, 3, 7, 13, 25, 5, 71, 207, 251, 367, 665 } },
+    { 11, 453, { 1, 3, 3, 3, 21, 25, 75, 35, 31, 321, 1603 } },
+    { 11, 457, { 1, 1, 1, 9, 11, 1, 65, 5, 11, 329, 535 } },
+    { 11, 458, { 1, 1, 5, 3, 19, 13, 17, 43, 379, 485, 383 } },
+    { 11, 471, { 1, 3, 5, 13, 13, 9, 85, 147, 489, 787, 1133 } },
+    { 11, 475, { 1, 3, 1, 1, 5, 51, 37, 129, 195, 297, 1783 } },
+    { 11, 478, { 1, 1, 3, 15, 19, 57, 59, 181, 455, 697, 2033 } },
+    { 11, 484, { 1, 3, 7, 1, 27, 9, 65, 145, 325, 189, 201 } },
+    { 11, 493, { 1, 3, 1, 15, 31, 23, 19, 5, 485, 581, 539 } },
+    { 11, 494, { 1, 1, 7, 13, 11, 15, 65, 83, 185, 847, 831 } },
+    { 11, 499, { 1, 3, 5, 7, 7, 55, 73, 15, 303, 511, 1905 } },
+    { 11, 502, { 1, 3, 5, 9, 7, 21, 45, 15, 397, 385, 597 } },
+    { 11, 517, { 1, 3, 7, 3, 23, 13, 73, 221, 511, 883, 1265 } },
+    { 11, 518, { 1, 1, 3, 11, 1, 51, 73, 185, 33, 975, 1441 } },
+    { 11, 524, { 1, 3, 3, 9, 19, 59, 21, 39, 339, 37, 143 } },
+    { 11, 527, { 1, 1, 7, 1, 31, 33, 19, 167, 117, 635, 639 } },
+    { 11, 555, { 1, 1, 1, 3, 5, 13, 59, 83, 355, 349, 1967 } },
+    { 11, 560, { 1, 1, 1, 5, 19, 3, 53, 133, 97, 863, 983 } },
+};
+
+static const int sobol_max_dim = 1 + sizeof(sobol_init) / sizeof(sobol_init[0]);
+static const int halton_max_dim = 1000;
+
+// Each thread caches the dimensions it used; the cache is cleared when it
+// reaches this size, so that e.g. sobol(i, 1, seed) with varying seeds does
+// not grow it without bound
+static const size_t qmc_cache_limit = 1024;
+
+// Sobol points with consecutive indices are generated in blocks of this size
+static const uint32_t sobol_block_size = 64;
+
+// Direction numbers (Sobol) or digit permutations (Halton) of one dimension.
+// For Sobol, the last generated block of points is kept, too.
+struct QmcDimension
+{
+    uint32_t direction[32];
+    std::vector<int> permutation;
+    uint32_t last_index;
+    uint32_t block_start;
+    uint32_t block_length;
+    uint32_t block[sobol_block_size];
+};
+
+static QmcDimension& sobol_dimension(int dim, bool scrambled, unsigned long seed)
+{
+    static thread_local std::map<std::pair<int, unsigned long>, QmcDimension> cache;
+    std::pair<int, unsigned long> key(scrambled ? -dim : dim, seed);
+    std::map<std::pair<int, unsigned long>, QmcDimension>::iterator it = cache.find(key);
+    if (it != cache.end())
+        return it->second;
+    if (cache.size() >= qmc_cache_limit)
+        cache.clear();
+    QmcDimension& d = cache[key];
+    d.last_index = 0;
+    d.block_start = 0;
+    d.block_length = 0;
+    uint64_t m[33];
+    if (dim == 1) {
+        for (int k = 1; k <= 32; k++)
+            m[k] = 1;
+    } else {
+        const SobolInit& init = sobol_init[dim - 2];
+        int s = init.s;
+        for (int k = 1; k <= s; k++)
+            m[k] = init.m[k - 1];
+        for (int k = s + 1; k <= 32; k++) {
+            m[k] = m[k - s] ^ (m[k - s] << s);
+            for (int j = 1; j < s; j++)
+                if ((init.a >> (s - 1 - j)) & 1)
+                    m[k] ^= m[k - j] << j;
+        }
+    }
+    for (int k = 1; k <= 32; k++)
+        d.direction[k - 1] = m[k] << (32 - k);
+    if (scrambled) {
+        // Multiply the direction numbers with a random lower triangular
+        // binary matrix with unit diagonal; bit 31 is the first digit
+        std::seed_seq seq { seed, static_cast<unsigned long>(dim) };
+        std::mt19937_64 rng(seq);
+        uint32_t rows[32];
+        for (int r = 0; r < 32; r++) {
+            uint32_t below_diagonal = (r == 0 ? 0 : static_cast<uint32_t>(rng()) & ~(0xffffffffu >> r));
+            rows[r] = below_diagonal | (1u << (31 - r));
+        }
+        for (int k = 0; k < 32; k++) {
+            uint32_t v = 0;
+            for (int r = 0; r < 32; r++) {
+                uint32_t bits = d.direction[k] & rows[r];
+                int parity = 0;
+                while (bits) {
+                    parity ^= 1;
+                    bits &= bits - 1;
+                }
+                v |= static_cast<uint32_t>(parity) << (31 - r);
+            }
+            d.direction[k] = v;
+        }
+        // the digital shift is stored as permutation[0]
+        d.permutation.assign(1, static_cast<int>(rng() >> 32));
+    }
+    return d;
+}
+
+static const QmcDimension& halton_dimension(int base, int dim, bool scrambled, unsigned long seed)
+{
+    static thread_local std::map<std::pair<int, unsigned long>, QmcDimension> cache;
+    std::pair<int, unsigned long> key(scrambled ? -dim : dim, seed);
+    std::map<std::pair<int, unsigned long>, QmcDimension>::iterator it = cache.find(key);
+    if (it != cache.end())
+        return it->second;
+    if (cache.size() >= qmc_cache_limit)
+        cache.clear();
+    QmcDimension& d = cache[key];
+    d.permutation.resize(base);
+    for (int i = 0; i < base; i++)
+        d.permutation[i] = i;
+    if (scrambled) {
+        std::seed_seq seq { seed, static_cast<unsigned long>(dim) };
+        std::mt19937_64 rng(seq);
+        std::shuffle(d.permutation.begin(), d.permutation.end(), rng);
+    }
+    return d;
+}
+
+// Check the arguments (i, dim[, seed]) of sobol() and halton()
+static bool qmc_args(const double* x, int n, int max_dim,
+        uint32_t* i, int* dim, bool* scrambled, unsigned long* seed)
+{
+    if (n < 2 || n > 3)
+        return false;
+    if (!(x[0] >= 0.0 && x[0] <= 4294967295.0 && x[0] == std::floor(x[0])))
+        return false;
+    if (!(x[1] >= 1.0 && x[1] <= max_dim && x[1] == std::floor(x[1])))
+        return false;
+    *i = x[0];
+    *dim = x[1];
+    *scrambled = (n == 3);
+    *seed = 0;
+    if (n == 3) {
+        if (!(x[2] >= 0.0 && x[2] <= 9007199254740992.0 && x[2] == std::floor(x[2])))
+            return false;
+        *seed = x[2];
+    }
+    return true;
+}
+
+static double sobol(const double* x, int n)
+{
+    uint32_t i;
+    int dim;
+    bool scrambled;
+    unsigned long seed;
+    if (!qmc_args(x, n, sobol_max_dim, &i, &dim, &scrambled, &seed))
+        return NAN;
+    QmcDimension& d = sobol_dimension(dim, scrambled, seed);
+    uint32_t offset = i - d.block_start;
+    if (offset < d.block_length) {
+        d.last_index = i;
+        return d.block[offset] / 4294967296.0;
+    }
+    uint32_t result = (scrambled ? d.permutation[0] : 0);
+    for (uint32_t j = i, k = 0; j != 0; k++, j >>= 1)
+        if (j & 1)
+            result ^= d.direction[k];
+    if (i != 0 && i - 1 == d.last_index) {
+        // Sequential access, e.g. one point per input line: generate the
+        // following points, too. From point j to j + 1, the bits 0 to t
+        // of the index flip, where t is the number of trailing ones of j.
+        d.block_start = i;
+        d.block[0] = result;
+        uint32_t v = result;
+        uint32_t j = i;
+        for (d.block_length = 1; d.block_length < sobol_block_size && j != 0xffffffffu; d.block_length++, j++) {
+            for (uint32_t flipped = j ^ (j + 1), k = 0; flipped != 0; k++, flipped >>= 1)
+                v ^= d.direction[k];
+            d.block[d.block_length] = v;
+        }
+    }
+    d.last_index = i;
+    return result / 4294967296.0;
+}
+
+static double halton(const double* x, int n)
+{
+    static const std::vector<int> primes = []() {
+        std::vector<int> p;
+        for (int candidate = 2; p.size() < static_cast<size_t>(halton_max_dim); candidate++) {
+            bool is_prime = true;
+            for (size_t j = 0; j < p.size() && p[j] * p[j] <= candidate && is_prime; j++)
+                is_prime = (candidate % p[j] != 0);
+            if (is_prime)
+                p.push_back(candidate);
+        }
+        return p;
+    }();
+    uint32_t i;
+    int dim;
+    bool scrambled;
+    unsigned long seed;
+    if (!qmc_args(x, n, halton_max_dim, &i, &dim, &scrambled, &seed))
+        return NAN;
+    int base = primes[dim - 1];
+    const QmcDimension& d = halton_dimension(base, dim, scrambled, seed);
+    double result = 0.0;
+    double f = 1.0 / base;
+    for (; i != 0; i /= base, f /= base)
+        result += d.permutation[i % base] * f;
+    // the infinitely many leading zeros of i are permuted, too
+    result += d.permutation[0] * f * base / (base - 1);
+    return std::min(result, 1.0 - DBL_EPSILON / 2);
+}
+
+static uint64_t fnv1a_hash(const char* s, size_t n)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (size_t i = 0; i < n; i++)
+        hash = (hash ^ static_cast<unsigned char>(s[i])) * UINT64_C(0x100000001b3);
+    return hash;
+}
+
+// Lookup tables for lookup("table.csv", key, col). Each line of a table
+// holds a numeric key and values, separated by commas, semicolons, or blanks;
+// lines that start with # or do not start with a number are skipped. Keys
+// are found in O(1) with an open addressing hash table. The first key wins
+// if keys repeat. Tables are loaded once per process. With --lookup-cache, the
+// parsed table is also stored as a binary cache file that is memory-mapped on
+// reuse, as long as the size and modification time of the table file are
+// unchanged.
+struct LookupCacheHeader
+{
+    char magic[8];
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint64_t rows;
+    uint64_t cols;          // value columns, without the key
+    uint64_t capacity_log2; // hash table slots
+    uint64_t reserved;
+};
+
+static const char lookup_cache_magic[8] = { 'M', 'U', 'L', 'O', 'O', 'K', '0', '1' };
+static const uint32_t lookup_empty_slot = 0xffffffff;
+static bool lookup_cache_enabled = false;
+
+class LookupTable
+{
+private:
+    MappedFile _cache;
+    std::vector<char> _data;  // the cache file contents if not mapped
+    const LookupCacheHeader* _header;
+    const double* _keys;      // per slot
+    const uint32_t* _rows;    // per slot, lookup_empty_slot for none
+    const double* _values;    // rows * cols
+
+    static uint64_t key_bits(double key)
+    {
+        if (key == 0.0)
+            key = 0.0;      // -0 == 0
+        uint64_t bits;
+        memcpy(&bits, &key, sizeof(bits));
+        return bits;
+    }
+
+    static size_t slot(double key, uint64_t capacity_log2)
+    {
+        return (key_bits(key) * UINT64_C(0x9e3779b97f4a7c15)) >> (64 - capacity_log2);
+    }
+
+    static size_t layout_size(uint64_t rows, uint64_t cols, uint64_t capacity_log2)
+    {
+        size_t capacity = static_cast<size_t>(1) << capacity_log2;
+        return sizeof(LookupCacheHeader) + capacity * (sizeof(double) + sizeof(uint32_t)) + rows * cols * sizeof(double);
+    }
+
+    void set_pointers(const char* data)
+    {
+        _header = reinterpret_cast<const LookupCacheHeader*>(data);
+        size_t capacity = static_cast<size_t>(1) << _header->capacity_log2;
+        _keys = reinterpret_cast<const double*>(data + sizeof(LookupCacheHeader));
+        _rows = reinterpret_cast<const uint32_t*>(_keys + capacity);
+        _values = reinterpret_cast<const double*>(_rows + capacity);
+    }
+
+    // Check that a cache file cannot lead lookup() out of bounds: each slot
+    // refers to an existing row, and there are empty slots to end the search
+    bool valid_slots() const
+    {
+        size_t capacity = static_cast<size_t>(1) << _header->capacity_log2;
+        size_t empty_slots = 0;
+        for (size_t i = 0; i < capacity; i++) {
+            if (_rows[i] == lookup_empty_slot)
+                empty_slots++;
+            else if (_rows[i] >= _header->rows)
+                return false;
+        }
+        return (empty_slots > 0);
+    }
+
+    // Parse the table file into the cache layout
+    bool parse(const std::string& file_name, const MappedFile& file, const LookupCacheHeader& source)
+    {
+        std::vector<double> keys, values;
+        size_t cols = 0;
+        const char* p = file.data();
+        const char* end = p + file.size();
+        std::vector<double> row;
+        while (p < end) {
+            const char* line_end = static_cast<const char*>(memchr(p, '\n', end - p));
+            if (!line_end)
+                line_end = end;
+            std::string line(p, line_end);
+            p = line_end + 1;
+            const char* q = line.c_str();
+            row.clear();
+            for (;;) {
+                while (*q == ' ' || *q == '\t' || *q == '\r')
+                    q++;
+                if (!*q || (row.empty() && *q == '#'))
+                    break;
+                char* number_end;
+                double v = strtod(q, &number_end);
+                if (number_end == q) {
+                    if (row.empty())
+                        break;  // e.g. a header line
+                    v = NAN;
+                }
+                row.push_back(v);
+                q = number_end;
+                while (*q && !strchr(",; \t\r", *q))
+                    q++;
+                while (*q == ' ' || *q == '\t')
+                    q++;
+                if (*q == ',' || *q == ';')
+                    q++;
+            }
+            if (row.empty())
+                continue;
+            if (keys.size() >= lookup_empty_slot) {
+                fprintf(stderr, "%s: too many rows\n", file_name.c_str());
+                return false;
+            }
+            if (row.size() - 1 > cols) {
+                // pad the previous rows with NaN for the new columns
+                std::vector<double> padded(keys.size() * (row.size() - 1), NAN);
+                for (size_t r = 0; r < keys.size(); r++)
+                    std::copy(values.begin() + r * cols, values.begin() + (r + 1) * cols, padded.begin() + r * (row.size() - 1));
+                values.swap(padded);
+                cols = row.size() - 1;
+            }
+            keys.push_back(row[0]);
+            values.insert(values.end(), row.begin() + 1, row.end());
+            values.resize(keys.size() * cols, NAN);
+        }
+
+        LookupCacheHeader header = source;
+        memcpy(header.magic, lookup_cache_magic, sizeof(header.magic));
+        header.rows = keys.size();
+        header.cols = cols;
+        header.capacity_log2 = 1;
+        while ((static_cast<uint64_t>(1) << header.capacity_log2) < 2 * header.rows)
+            header.capacity_log2++;
+        _data.assign(layout_size(header.rows, header.cols, header.capacity_log2), 0);
+        memcpy(_data.data(), &header, sizeof(header));
+        set_pointers(_data.data());
+        double* slot_keys = const_cast<double*>(_keys);
+        uint32_t* slot_rows = const_cast<uint32_t*>(_rows);
+        size_t mask = (static_cast<size_t>(1) << header.capacity_log2) - 1;
+        std::fill(slot_rows, slot_rows + mask + 1, lookup_empty_slot);
+        for (size_t r = 0; r < keys.size(); r++) {
+            if (std::isnan(keys[r]))
+                continue;
+            size_t i = slot(keys[r], header.capacity_log2);
+            while (slot_rows[i] != lookup_empty_slot && slot_keys[i] != keys[r])
+                i = (i + 1) & mask;
+            if (slot_rows[i] == lookup_empty_slot) {
+                slot_keys[i] = keys[r];
+                slot_rows[i] = r;
+            }
+        }
+        std::copy(values.begin(), values.end(), const_cast<double*>(_values));
+        return true;
+    }
+
+#ifdef __linux__
+    // The cache file is in $XDG_CACHE_HOME/mucalc or ~/.cache/mucalc, named
+    // by a hash of the absolute table file name
+    static std::string cache_file_name(const std::string& file_name)
+    {
+        std::string dir;
+        const char* cache_home = getenv("XDG_CACHE_HOME");
+        const char* home = getenv("HOME");
+        if (cache_home && *cache_home)
+            dir = std::string(cache_home) + "/mucalc";
+        else if (home)
+            dir = std::string(home) + "/.cache/mucalc";
+        else
+            return std::string();
+        char* path = realpath(file_name.c_str(), NULL);
+        if (!path)
+            return std::string();
+        std::string absolute_name = path;
+        free(path);
+        // the cache directory may not exist yet
+        mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0777);
+        mkdir(dir.c_str(), 0777);
+        uint64_t hash = fnv1a_hash(absolute_name.data(), absolute_name.size());
+        char name[32];
+        snprintf(name, sizeof(name), "/lookup-%016llx", static_cast<unsigned long long>(hash));
+        return dir + name;
+    }
+#endif
+
+public:
+    LookupTable() : _header(NULL), _keys(NULL), _rows(NULL), _values(NULL)
+    {
+    }
+
+    bool load(const std::string& file_name)
+    {
+        LookupCacheHeader source;
+        memset(&source, 0, sizeof(source));
+#ifdef __linux__
+        struct stat st;
+        if (stat(file_name.c_str(), &st) != 0) {
+            fprintf(stderr, "%s: %s\n", file_name.c_str(), strerror(errno));
+            return false;
+        }
+        source.source_size = st.st_size;
+        source.source_mtime_sec = st.st_mtim.tv_sec;
+        source.source_mtime_nsec = st.st_mtim.tv_nsec;
+        // Use the cache if it is valid
+        std::string cache_name = (lookup_cache_enabled ? cache_file_name(file_name) : std::string());
+        if (!cache_name.empty() && access(cache_name.c_str(), R_OK) == 0 && _cache.open(cache_name)) {
+            const LookupCacheHeader* h = reinterpret_cast<const LookupCacheHeader*>(_cache.data());
+            if (_cache.size() >= sizeof(LookupCacheHeader)
+                    && memcmp(h->magic, lookup_cache_magic, sizeof(h->magic)) == 0
+                    && h->source_size == source.source_size
+                    && h->source_mtime_sec == source.source_mtime_sec
+                    && h->source_mtime_nsec == source.source_mtime_nsec
+                    && h->capacity_log2 > 0 && h->capacity_log2 < 40
+                    && h->rows < lookup_empty_slot && h->cols < (UINT64_C(1) << 32)
+                    && _cache.size() == layout_size(h->rows, h->cols, h->capacity_log2)) {
+                set_pointers(_cache.data());
+                if (valid_slots())
+                    return true;
+            }
+            _cache.close();
+        }
+#endif
+        MappedFile file;
+        if (!file.open(file_name) || !parse(file_name, file, source))
+            return false;
+#ifdef __linux__
+        // Write the cache file under a temporary name and rename it, so that
+        // concurrent processes never see a partial cache
+        if (!cache_name.empty()) {
+            std::string tmp_name = cache_name + "." + std::to_string(getpid()) + ".tmp";
+            int fd = ::open(tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd >= 0) {
+                bool ok = (write(fd, _data.data(), _data.size()) == static_cast<ssize_t>(_data.size()));
+                ok = (::close(fd) == 0) && ok;
+                if (!ok || rename(tmp_name.c_str(), cache_name.c_str()) != 0)
+                    remove(tmp_name.c_str());
+            }
+        }
+#endif
+        return true;
+    }
+
+    // The value in column col of the row with the given key, where column 1
+    // holds the key itself, or NaN
+    double lookup(double key, double col) const
+    {
+        if (std::isnan(key) || !(col >= 1.0 && col <= _header->cols + 1.0 && col == std::floor(col)))
+            return NAN;
+        size_t mask = (static_cast<size_t>(1) << _header->capacity_log2) - 1;
+        for (size_t i = slot(key, _header->capacity_log2); _rows[i] != lookup_empty_slot; i = (i + 1) & mask) {
+            if (_keys[i] == key)
+                return (col == 1.0 ? key : _values[_rows[i] * _header->cols + static_cast<size_t>(col) - 2]);
+        }
+        return NAN;
+    }
+};
+
+// The tables loaded so far by file name; NULL for files that failed to load,
+// so that errors are reported once. Tables are never unloaded.
+static std::mutex lookup_tables_mutex;
+static std::map<std::string, std::unique_ptr<LookupTable>> lookup_tables;
+
+static const LookupTable* lookup_table(const char* file_name)
+{
+    // Each thread remembers the last table, so that the common case of one
+    // table per expression needs no locking
+    thread_local std::string last_name;
+    thread_local const LookupTable* last_table = NULL;
+    if (last_table && last_name == file_name)
+        return last_table;
+    std::lock_guard<std::mutex> lock(lookup_tables_mutex);
+    std::map<std::string, std::unique_ptr<LookupTable>>::iterator it = lookup_tables.find(file_name);
+    if (it == lookup_tables.end()) {
+        std::unique_ptr<LookupTable> table(new LookupTable);
+        if (!table->load(file_name))
+            table.reset();
+        it = lookup_tables.insert(std::make_pair(std::string(file_name), std::move(table))).first;
+    }
+    last_name = file_name;
+    last_table = it->second.get();
+    return last_table;
+}
+
+static double lookup(const char* file_name, double key, double col)
+{
+    const LookupTable* table = lookup_table(file_name);
+    return (table ? table->lookup(key, col) : NAN);
+}
+
+static void init_prng(unsigned int thread_index = 0)
+{
+    std::seed_seq seq { static_cast<unsigned long>(std::chrono::system_clock::now().time_since_epoch().count()),
+        static_cast<unsigned long>(thread_index) };
+    prng.seed(seq);
+}
+
+/* muparser implicit variable definitions */
+
+// Variables created by a parser's variable factory. The parser refers to
+// the values by address, so each value has its own heap cell; the cells of
+// removed variables are kept and reused for new ones.
+class VarList
+{
+private:
+    std::vector<std::pair<std::string, std::unique_ptr<double>>> _vars;
+    std::vector<std::unique_ptr<double>> _free_cells;
+
+public:
+    bool empty() const
+    {
+        return _vars.empty();
+    }
+
+    size_t size() const
+    {
+        return _vars.size();
+    }
+
+    size_t free_cells() const
+    {
+        return _free_cells.size();
+    }
+
+    const std::pair<std::string, std::unique_ptr<double>>& operator[](size_t i) const
+    {
+        return _vars[i];
+    }
+
+    double* add(const char* name)
+    {
+        std::unique_ptr<double> cell;
+        if (_free_cells.empty()) {
+            cell.reset(new double);
+        } else {
+            cell = std::move(_free_cells.back());
+            _free_cells.pop_back();
+        }
+        *cell = 0.0;
+        _vars.push_back(std::make_pair(std::string(name), std::move(cell)));
+        return _vars.back().second.get();
+    }
+
+    // The caller must remove the parser binding as well
+    bool remove(const std::string& name)
+    {
+        for (size_t i = 0; i < _vars.size(); i++) {
+            if (_vars[i].first == name) {
+                _free_cells.push_back(std::move(_vars[i].second));
+                _vars.erase(_vars.begin() + i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < _vars.size(); i++)
+            _free_cells.push_back(std::move(_vars[i].second));
+        _vars.clear();
+    }
+
+    // Approximate heap memory used, including the parser bindings
+    size_t memory() const
+    {
+        const size_t map_node_size = 4 * sizeof(void*) + sizeof(std::string) + sizeof(double*);
+        size_t bytes = _vars.capacity() * sizeof(_vars[0])
+            + _free_cells.capacity() * sizeof(_free_cells[0])
+            + (_vars.size() + _free_cells.size()) * sizeof(double);
+        for (size_t i = 0; i < _vars.size(); i++) {
+            // names that do not fit into the string object itself
+            size_t name_bytes = _vars[i].first.capacity() + 1;
+            if (name_bytes > sizeof(std::string))
+                bytes += 2 * name_bytes; // here and in the parser
+            bytes += map_node_size;
+        }
+        return bytes;
+    }
+};
+
+/* names of constants and functions */
+
+static const char* constant_names[] = {
+    "pi", "e",
+    NULL
+};
+
+static const char* function_names[] = {
+    "deg", "rad",
+    "sin", "asin", "cos", "acos", "tan", "atan", "atan2",
+    "sinh", "asinh", "cosh", "acosh", "tanh", "atanh",
+    "pow", "exp", "exp2", "exp10", "log", "ln", "log2", "log10",
+    "sqrt", "cbrt", "abs", "sign",
+    "fract", "int", "ceil", "floor", "round", "rint", "trunc",
+    "min", "max", "sum", "avg", "med",
+    "clamp", "step", "smoothstep", "mix",
+    "erf", "erfc", "tgamma", "lgamma", "beta", "normcdf", "norminv",
+    "sobol", "halton", "lookup",
+    "seed", "random", "gaussian",
+    "exponential", "poisson", "binomial", "gamma", "discrete",
+    NULL
+};
+
+// functions that depend on or modify state
+static const char* impure_function_names[] = {
+    "seed", "random", "gaussian",
+    "exponential", "poisson", "binomial", "gamma", "discrete",
+    NULL
+};
+
+static bool name_in_list(const char* name, size_t len, const char** list)
+{
+    for (int i = 0; list[i]; i++)
+        if (strncmp(name, list[i], len) == 0 && list[i][len] == '\0')
+            return true;
+    return false;
+}
+
+/* shared parameter store */
+
+// A parameter store is a file with a hash table from names to values. It is
+// created once with --params-create from lines of "name value", and each
+// process that uses it with --params maps it into memory, so that all of
+// them share one copy and start without parsing. Parameters are bound when
+// an expression first uses them, through the variable factory. The mapping
+// is copy-on-write: assigning to a parameter changes the value only for the
+// process that does it.
+struct ParamStoreHeader
+{
+    char magic[8];
+    uint64_t count;
+    uint64_t capacity_log2;
+    uint64_t names_offset;
+};
+
+struct ParamSlot
+{
+    uint64_t hash;
+    uint32_t name_offset;   // relative to the names
+    uint32_t name_length;   // 0 for empty slots
+    double value;
+};
+
+static const char param_store_magic[8] = { 'M', 'U', 'P', 'A', 'R', 'A', 'M', '1' };
+
+class ParamStore
+{
+private:
+    MappedFile _file;
+    const ParamStoreHeader* _header;
+    ParamSlot* _slots;
+    const char* _names;
+    size_t _names_size;
+
+    static bool valid_name(const std::string& name)
+    {
+        if (name.empty() || isdigit(static_cast<unsigned char>(name[0])))
+            return false;
+        for (size_t i = 0; i < name.size(); i++)
+            if (!isalnum(static_cast<unsigned char>(name[i])) && name[i] != '_')
+                return false;
+        return true;
+    }
+
+public:
+    ParamStore() : _header(NULL), _slots(NULL), _names(NULL), _names_size(0)
+    {
+    }
+
+    bool open(const std::string& file_name)
+    {
+        if (!_file.open(file_name, true))
+            return false;
+        const char* data = _file.data();
+        size_t size = _file.size();
+        _header = reinterpret_cast<const ParamStoreHeader*>(data);
+        if (size < sizeof(ParamStoreHeader)
+                || memcmp(_header->magic, param_store_magic, sizeof(_header->magic)) != 0
+                || _header->capacity_log2 < 1 || _header->capacity_log2 > 40
+                || _header->names_offset != sizeof(ParamStoreHeader)
+                        + (static_cast<uint64_t>(1) << _header->capacity_log2) * sizeof(ParamSlot)
+                || _header->names_offset > size
+                || _header->count >= (static_cast<uint64_t>(1) << _header->capacity_log2)) {
+            fprintf(stderr, "%s: not a parameter store\n", file_name.c_str());
+            _file.close();
+            _header = NULL;
+            return false;
+        }
+        _slots = reinterpret_cast<ParamSlot*>(_file.data() + sizeof(ParamStoreHeader));
+        _names = data + _header->names_offset;
+        _names_size = size - _header->names_offset;
+        return true;
+    }
+
+    size_t size() const
+    {
+        return (_header ? _header->count : 0);
+    }
+
+    // The address of the value of the parameter, or NULL. The probes are
+    // bounded by the capacity, since a damaged store may have no empty slot.
+    double* find(const char* name) const
+    {
+        if (!_header)
+            return NULL;
+        size_t length = strlen(name);
+        uint64_t hash = fnv1a_hash(name, length);
+        size_t mask = (static_cast<size_t>(1) << _header->capacity_log2) - 1;
+        size_t i = hash >> (64 - _header->capacity_log2);
+        for (size_t probes = 0; probes <= mask && _slots[i].name_length != 0; probes++, i = (i + 1) & mask) {
+            const ParamSlot& slot = _slots[i];
+            if (slot.hash == hash && slot.name_length == length
+                    && static_cast<size_t>(slot.name_offset) + length <= _names_size
+                    && memcmp(_names + slot.name_offset, name, length) == 0)
+                return &(_slots[i].value);
+        }
+        return NULL;
+    }
+
+    // Create a store from lines of "name value" or "name = value" in input;
+    // later lines override earlier ones. The file is written under a
+    // temporary name and renamed, so that running processes keep their copy
+    // and concurrent creators do not write to the same file.
+    static bool create(const std::string& file_name, std::istream& input)
+    {
+        std::map<std::string, double> params;
+        std::string line;
+        size_t line_number = 0;
+        while (std::getline(input, line)) {
+            line_number++;
+            const char* p = line.c_str();
+            while (*p == ' ' || *p == '\t')
+                p++;
+            if (*p == '\0' || *p == '#' || *p == '\r')
+                continue;
+            const char* name_end = p;
+            while (isalnum(static_cast<unsigned char>(*name_end)) || *name_end == '_')
+                name_end++;
+            std::string name(p, name_end);
+            p = name_end;
+            while (*p == ' ' || *p == '\t' || *p == '=' || *p == ',')
+                p++;
+            char* end;
+            double value = strtod(p, &end);
+            while (*end == ' ' || *end == '\t' || *end == '\r')
+                end++;
+            if (!valid_name(name) || end == p || *end != '\0') {
+                fprintf(stderr, "Line %zu: expected a name and a value\n", line_number);
+                return false;
+            }
+            if (name == "_" || name_in_list(name.c_str(), name.size(), function_names)
+                    || name_in_list(name.c_str(), name.size(), constant_names)) {
+                fprintf(stderr, "Line %zu: %s is the name of a function or constant\n", line_number, name.c_str());
+                return false;
+            }
+            params[name] = value;
+        }
+
+        ParamStoreHeader header;
+        memcpy(header.magic, param_store_magic, sizeof(header.magic));
+        header.count = params.size();
+        header.capacity_log2 = 1;
+        while ((static_cast<uint64_t>(1) << header.capacity_log2) < 2 * header.count)
+            header.capacity_log2++;
+        size_t capacity = static_cast<size_t>(1) << header.capacity_log2;
+        header.names_offset = sizeof(ParamStoreHeader) + capacity * sizeof(ParamSlot);
+        std::vector<ParamSlot> slots(capacity);
+        memset(slots.data(), 0, capacity * sizeof(ParamSlot));
+        std::string names;
+        for (std::map<std::string, double>::const_iterator it = params.begin(); it != params.end(); ++it) {
+            if (names.size() + it->first.size() > 0xffffffffu) {
+                fprintf(stderr, "%s: too many parameters\n", file_name.c_str());
+                return false;
+            }
+            uint64_t hash = fnv1a_hash(it->first.data(), it->first.size());
+            size_t i = hash >> (64 - header.capacity_log2);
+            while (slots[i].name_length != 0)
+                i = (i + 1) & (capacity - 1);
+            slots[i].hash = hash;
+            slots[i].name_offset = names.size();
+            slots[i].name_length = it->first.size();
+            slots[i].value = it->second;
+            names += it->first;
+        }
+
+        std::string tmp_name = file_name + "." + std::to_string(getpid()) + ".tmp";
+        FILE* f = fopen(tmp_name.c_str(), "wb");
+        if (!f) {
+            fprintf(stderr, "%s: %s\n", tmp_name.c_str(), strerror(errno));
+            return false;
+        }
+        bool ok = (fwrite(&header, sizeof(header), 1, f) == 1)
+            && (fwrite(slots.data(), sizeof(ParamSlot), capacity, f) == capacity)
+            && (fwrite(names.data(), 1, names.size(), f) == names.size());
+        ok = (fclose(f) == 0) && ok;
+        if (!ok || rename(tmp_name.c_str(), file_name.c_str()) != 0) {
+            fprintf(stderr, "%s: %s\n", file_name.c_str(), strerror(errno));
+            remove(tmp_name.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+// Set up in main() with --params
+static ParamStore param_store;
+
+// variables of the main parser; evaluation threads have their own lists
+static VarList added_vars;
+// locked while the main parser is used by the interactive job thread
+static std::mutex added_vars_mutex;
+// parameters bound by the main parser, with their values from the store,
+// so that unset and clear can restore them
+static std::vector<std::pair<std::string, double>> added_params;
+
+static double* add_var(const char* name, void* data)
+{
+    double* param = param_store.find(name);
+    if (param) {
+        if (data == &added_vars)
+            added_params.push_back(std::make_pair(std::string(name), *param));
+        return param;
+    }
+    VarList* vars = static_cast<VarList*>(data);
+    return vars->add(name);
+}
+
+/* cancellation of interactive jobs */
+
+// The interactive job thread points this at its cancel flag. The long parts
+// of an evaluation check it: the huge list fast path for each block, the
+// parallel evaluation of expression lists for each part, and sum(), avg(),
+// and med(), whose argument lists can be huge. Parsing by muparser and other
+// functions cannot be interrupted.
+static thread_local const std::atomic<bool>* eval_cancel_flag = NULL;
+
+static bool eval_canceled()
+{
+    return (eval_cancel_flag && eval_cancel_flag->load(std::memory_order_relaxed));
+}
+
+static void check_canceled()
+{
+    if (eval_canceled())
+        throw mu::Parser::exception_type(mu::ecINTERNAL_ERROR, 0, "canceled");
+}
+
+static double sum_(const double* x, int n)
+{
+    check_canceled();
+    return mucalc::sum(x, n);
+}
+
+static double avg_(const double* x, int n)
+{
+    check_canceled();
+    return mucalc::avg(x, n);
+}
+
+static double med_(const double* x, int n)
+{
+    check_canceled();
+    return mucalc::med(x, n);
+}
+
+/* muparser initialization */
+
+static void init_parser(mu::Parser& parser, VarList* vars, double* last_result)
+{
+    parser.ClearConst();
+    parser.DefineConst("e", mucalc::e);
+    parser.DefineConst("pi", mucalc::pi);
+    parser.DefineOprt("%", mucalc::mod, mu::prMUL_DIV, mu::oaLEFT, true);
+    parser.DefineFun("deg", mucalc::deg);
+    parser.DefineFun("rad", mucalc::rad);
+    parser.DefineFun("atan2", atan2);
+    parser.DefineFun("fract", mucalc::fract);
+    parser.DefineFun("pow", pow);
+    parser.DefineFun("exp2", exp2);
+    parser.DefineFun("cbrt", cbrt);
+    parser.DefineFun("int", mucalc::int_);
+    parser.DefineFun("ceil", ceil);
+    parser.DefineFun("floor", floor);
+    parser.DefineFun("round", round);
+    parser.DefineFun("trunc", trunc);
+    parser.DefineFun("sum", sum_);
+    parser.DefineFun("avg", avg_);
+    parser.DefineFun("med", med_);
+    parser.DefineFun("clamp", mucalc::clamp);
+    parser.DefineFun("step", mucalc::step);
+    parser.DefineFun("smoothstep", mucalc::smoothstep);
+    parser.DefineFun("mix", mucalc::mix);
+    parser.DefineFun("erf", erf);
+    parser.DefineFun("erfc", erfc);
+    parser.DefineFun("tgamma", tgamma);
+    parser.DefineFun("lgamma", static_cast<double (*)(double)>(mucalc::lgamma));
+    parser.DefineFun("beta", mucalc::beta);
+    parser.DefineFun("normcdf", mucalc::normcdf);
+    parser.DefineFun("norminv", mucalc::norminv);
+    parser.DefineFun("seed", seed, false);
+    parser.DefineFun("random", random_, false);
+    parser.DefineFun("gaussian", gaussian, false);
+    parser.DefineFun("exponential", exponential, false);
+    parser.DefineFun("poisson", poisson, false);
+    parser.DefineFun("binomial", binomial, false);
+    parser.DefineFun("gamma", gamma_, false);
+    parser.DefineFun("discrete", discrete, false);
+    parser.DefineFun("sobol", sobol);
+    parser.DefineFun("halton", halton);
+    parser.DefineFun("lookup", lookup);
+    parser.DefineInfixOprt("+", unary_plus);
+    parser.SetVarFactory(add_var, vars);
+    parser.DefineVar("_", last_result);
+}
+
+/* memory allocation statistics */
+
+// Builds with MUCALC_COUNT_ALLOCATIONS (a CMake option, and the
+// mucalc-counting target measured by the performance fuzzer) replace
+// operator new to count heap allocations and bytes, so that --profile can
+// report them. Counting is only enabled for --profile, before any threads
+// are started, so that normal runs do not pay for the atomic operations.
+// Other builds use the standard allocator. The replacement functions must
+// not be inlined, otherwise compilers see malloc()/free() pairs that look
+// mismatched with new/delete.
+#ifdef MUCALC_COUNT_ALLOCATIONS
+static bool count_heap_allocations = false;
+static std::atomic<size_t> heap_allocations(0);
+static std::atomic<size_t> heap_bytes(0);
+
+#ifdef __GNUC__
+# define MUCALC_NOINLINE __attribute__((noinline))
+#else
+# define MUCALC_NOINLINE
+#endif
+
+MUCALC_NOINLINE void* operator new(size_t size)
+{
+    if (count_heap_allocations) {
+        heap_allocations.fetch_add(1, std::memory_order_relaxed);
+        heap_bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    void* p = malloc(size > 0 ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+MUCALC_NOINLINE void operator delete(void* p) noexcept
+{
+    free(p);
+}
+#endif
+
+/* large buffers backed by huge pages */
+
+// Bulk buffers of at least one huge page (output arenas, raster images, and
+// .npy conversions and results) are allocated with mmap() to reduce TLB
+// misses on big inputs: explicit huge pages (MAP_HUGETLB) are used if the
+// system has some reserved, otherwise transparent huge pages are requested
+// with madvise(MADV_HUGEPAGE). The kernel decides whether it grants them;
+// --profile reports the amount actually obtained from /proc. Smaller buffers
+// and other platforms use the normal heap.
+struct LargeAllocStats
+{
+    std::atomic<size_t> explicit_huge_bytes;
+    std::atomic<size_t> transparent_requested_bytes;
+    std::atomic<size_t> normal_bytes;
+};
+
+static LargeAllocStats large_alloc_stats;
+
+static size_t huge_page_size()
+{
+    // Thread-safe initialization on first use
+    static const size_t size = []() {
+        size_t size = 2 * 1024 * 1024;
+#ifdef __linux__
+        FILE* f = fopen("/proc/meminfo", "r");
+        if (f) {
+            char line[128];
+            unsigned long kb;
+            while (fgets(line, sizeof(line), f)) {
+                if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+                    size = kb * 1024;
+                    break;
+                }
+            }
+            fclose(f);
+        }
+#endif
+        return size;
+    }();
+    return size;
+}
+
+static bool large_alloc_uses_mmap(size_t size)
+{
+#ifdef __linux__
+    return size >= huge_page_size();
+#else
+    (void)size;
+    return false;
+#endif
+}
+
+static void* large_alloc(size_t size)
+{
+#ifdef __linux__
+    if (large_alloc_uses_mmap(size)) {
+        size_t rounded_size = (size + huge_page_size() - 1) / huge_page_size() * huge_page_size();
+        void* p = mmap(NULL, rounded_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            large_alloc_stats.explicit_huge_bytes += rounded_size;
+            return p;
+        }
+        p = mmap(NULL, rounded_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::bad_alloc();
+        if (madvise(p, rounded_size, MADV_HUGEPAGE) == 0)
+            large_alloc_stats.transparent_requested_bytes += rounded_size;
+        else
+            large_alloc_stats.normal_bytes += rounded_size;
+        return p;
+    }
+#endif
+    void* p = malloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    large_alloc_stats.normal_bytes += size;
+    return p;
+}
+
+static void large_free(void* p, size_t size)
+{
+    if (!p)
+        return;
+#ifdef __linux__
+    if (large_alloc_uses_mmap(size)) {
+        size_t rounded_size = (size + huge_page_size() - 1) / huge_page_size() * huge_page_size();
+        munmap(p, rounded_size);
+        return;
+    }
+#endif
+    free(p);
+}
+
+// Allocator for standard containers that hold bulk data
+template<typename T> class LargeAllocator
+{
+public:
+    typedef T value_type;
+
+    LargeAllocator()
+    {
+    }
+
+    template<typename U> LargeAllocator(const LargeAllocator<U>&)
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(large_alloc(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        large_free(p, n * sizeof(T));
+    }
+};
+
+template<typename T, typename U> bool operator==(const LargeAllocator<T>&, const LargeAllocator<U>&)
+{
+    return true;
+}
+
+template<typename T, typename U> bool operator!=(const LargeAllocator<T>&, const LargeAllocator<U>&)
+{
+    return false;
+}
+
+/* per-batch memory arena */
+
+// A monotonic buffer for the text that is produced while evaluating a batch
+// of lines (results and error messages). It is reset for each batch but keeps
+// its memory, so that after the first batches no allocations are necessary.
+class Arena
+{
+private:
+    char* _buffer;
+    size_t _size;
+    size_t _capacity;
+
+    void grow(size_t min_capacity)
+    {
+        size_t capacity = std::max(min_capacity, std::max(_capacity * 2, static_cast<size_t>(4096)));
+        char* buffer = static_cast<char*>(large_alloc(capacity));
+        if (_size > 0)
+            memcpy(buffer, _buffer, _size);
+        large_free(_buffer, _capacity);
+        _buffer = buffer;
+        _capacity = capacity;
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+public:
+    // Number of allocations made by all arenas
+    static std::atomic<size_t> allocations;
+
+    Arena() : _buffer(NULL), _size(0), _capacity(0)
+    {
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena()
+    {
+        large_free(_buffer, _capacity);
+    }
+
+    void reset()
+    {
+        _size = 0;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    const char* data(size_t offset = 0) const
+    {
+        return _buffer + offset;
+    }
+
+    void append(const char* s, size_t n)
+    {
+        if (_size + n > _capacity)
+            grow(_size + n);
+        memcpy(_buffer + _size, s, n);
+        _size += n;
+    }
+
+    void append(const char* s)
+    {
+        append(s, strlen(s));
+    }
+
+    void append(const std::string& s)
+    {
+        append(s.data(), s.length());
+    }
+
+    void append(char c)
+    {
+        append(&c, 1);
+    }
+
+    void append_number(size_t x)
+    {
+        char buf[24];
+        append(buf, snprintf(buf, sizeof(buf), "%zu", x));
+    }
+};
+
+std::atomic<size_t> Arena::allocations(0);
+
+// A part of an arena that contains the text for one line
+struct ArenaText
+{
+    size_t offset;
+    size_t length;
+};
+
+/* quick analysis of expressions without parsing them */
+
+struct ExprInfo
+{
+    bool uses_variables;        // any name that is not a function or constant
+    bool uses_impure_functions;
+    bool has_assignment;        // =, +=, -=, *=, /=
+    bool uses_last_result;      // the variable _
+};
+
+static ExprInfo analyze_expr(const std::string& expr)
+{
+    ExprInfo info = { false, false, false, false };
+    size_t len = expr.length();
+    size_t i = 0;
+    while (i < len) {
+        unsigned char c = expr[i];
+        if (isdigit(c) || c == '.') {
+            // skip number, including exponent
+            while (i < len && (isdigit(static_cast<unsigned char>(expr[i])) || expr[i] == '.'))
+                i++;
+            if (i < len && (expr[i] == 'e' || expr[i] == 'E')) {
+                i++;
+                if (i < len && (expr[i] == '+' || expr[i] == '-'))
+                    i++;
+                while (i < len && isdigit(static_cast<unsigned char>(expr[i])))
+                    i++;
+            }
+        } else if (c == '"') {
+            // skip string, e.g. a file name
+            i++;
+            while (i < len && expr[i] != '"')
+                i++;
+            i++;
+        } else if (isalpha(c) || c == '_') {
+            size_t j = i;
+            while (j < len && (isalnum(static_cast<unsigned char>(expr[j])) || expr[j] == '_'))
+                j++;
+            const char* name = expr.c_str() + i;
+            if (name_in_list(name, j - i, impure_function_names))
+                info.uses_impure_functions = true;
+            else if (j - i == 1 && c == '_')
+                info.uses_variables = info.uses_last_result = true;
+            else if (!name_in_list(name, j - i, function_names) && !name_in_list(name, j - i, constant_names))
+                info.uses_variables = true;
+            i = j;
+        } else {
+            if (c == '=' && (i == 0 || !strchr("=!<>", expr[i - 1])) && (i + 1 == len || expr[i + 1] != '='))
+                info.has_assignment = true;
+            i++;
+        }
+    }
+    return info;
+}
+
+/* expression trees */
+
+// Expressions in the muparser grammar as trees, for the long double
+// evaluation of --check-precision, --explain, and --profile-ops
+struct ExprNode
+{
+    enum Kind { Constant, Variable, String, Operator, Function, Conditional, Assignment };
+    Kind kind;
+    std::string name;   // operator, function, variable, or constant name
+    double value;       // value of constants
+    size_t begin, end;  // position in the expression
+    bool folded;        // constant computed from a subexpression
+    std::vector<std::unique_ptr<ExprNode>> args;
+
+    ExprNode(Kind k, const std::string& n, size_t b) :
+        kind(k), name(n), value(0.0), begin(b), end(b), folded(false)
+    {
+    }
+};
+
+typedef std::unique_ptr<ExprNode> ExprNodePtr;
+
+// Recursive descent parser for the muparser grammar that builds ExprNode
+// trees. A unary minus is an operator with one argument. Constants are not
+// folded here; see fold_constants().
+class ExprParser
+{
+private:
+    struct Unsupported {};
+
+    const std::string& _expr;
+    size_t _pos;
+
+    void skip_blanks()
+    {
+        while (_pos < _expr.size() && (_expr[_pos] == ' ' || _expr[_pos] == '\t'))
+            _pos++;
+    }
+
+    bool eat(const char* token)
+    {
+        skip_blanks();
+        size_t len = strlen(token);
+        if (_expr.compare(_pos, len, token) != 0)
+            return false;
+        const char* p = _expr.c_str() + _pos;
+        if (len == 1 && p[1] != '\0' && strchr("=<>&|!", p[0]) && strchr("=&|", p[1]))
+            return false;
+        _pos += len;
+        return true;
+    }
+
+    void expect(const char* token)
+    {
+        if (!eat(token))
+            throw Unsupported();
+    }
+
+    ExprNodePtr node(ExprNode::Kind kind, const std::string& name, size_t begin)
+    {
+        return ExprNodePtr(new ExprNode(kind, name, begin));
+    }
+
+    ExprNodePtr finish(ExprNodePtr n)
+    {
+        n->end = _pos;
+        return n;
+    }
+
+    ExprNodePtr binary(const char* op, ExprNodePtr x, ExprNodePtr y, size_t begin)
+    {
+        ExprNodePtr n = node(ExprNode::Operator, op, begin);
+        n->args.push_back(std::move(x));
+        n->args.push_back(std::move(y));
+        return finish(std::move(n));
+    }
+
+    ExprNodePtr primary()
+    {
+        skip_blanks();
+        size_t begin = _pos;
+        if (eat("(")) {
+            ExprNodePtr x = assignment();
+            expect(")");
+            return x;
+        }
+        const char* p = _expr.c_str() + _pos;
+        if (isdigit(static_cast<unsigned char>(*p)) || *p == '.') {
+            char* end;
+            ExprNodePtr c = node(ExprNode::Constant, std::string(), begin);
+            c->value = strtod(p, &end);
+            // muparser has no hexadecimal numbers
+            if (end == p || *end == 'x' || *end == 'X' || (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')))
+                throw Unsupported();
+            _pos += end - p;
+            c->end = _pos;
+            return c;
+        }
+        if (*p == '"') {
+            size_t close = _expr.find('"', _pos + 1);
+            if (close == std::string::npos)
+                throw Unsupported();
+            _pos = close + 1;
+            ExprNodePtr str = node(ExprNode::String, _expr.substr(begin + 1, close - begin - 1), begin);
+            str->end = _pos;
+            return str;
+        }
+        if (isalpha(static_cast<unsigned char>(*p)) || *p == '_') {
+            while (_pos < _expr.size() && (isalnum(static_cast<unsigned char>(_expr[_pos])) || _expr[_pos] == '_'))
+                _pos++;
+            std::string name = _expr.substr(begin, _pos - begin);
+            if (eat("(")) {
+                ExprNodePtr f = node(ExprNode::Function, name, begin);
+                if (!eat(")")) {
+                    do
+                        f->args.push_back(assignment());
+                    while (eat(","));
+                    expect(")");
+                }
+                return finish(std::move(f));
+            }
+            if (name_in_list(name.c_str(), name.size(), constant_names)) {
+                ExprNodePtr c = node(ExprNode::Constant, name, begin);
+                c->value = (name == "pi" ? mucalc::pi : mucalc::e);
+                c->end = _pos;
+                return c;
+            }
+            ExprNodePtr v = node(ExprNode::Variable, name, begin);
+            v->end = _pos;
+            return v;
+        }
+        throw Unsupported();
+    }
+
+    ExprNodePtr power()
+    {
+        skip_blanks();
+        size_t begin = _pos;
+        ExprNodePtr x = primary();
+        if (eat("^"))
+            return binary("^", std::move(x), unary(), begin);
+        return x;
+    }
+
+    ExprNodePtr unary()
+    {
+        skip_blanks();
+        size_t begin = _pos;
+        if (eat("-")) {
+            ExprNodePtr n = node(ExprNode::Operator, "-", begin);
+            n->args.push_back(unary());
+            return finish(std::move(n));
+        }
+        if (eat("+"))
+            return unary();
+        return power();
+    }
+
+    ExprNodePtr product()
+    {
+        skip_blanks();
+        size_t begin = _pos;
+        ExprNodePtr x = unary();
+        for (;;) {
+            if (eat("*"))
+                x = binary("*", std::move(x), unary(), begin);
+            else if (eat("/"))
+                x = binary("/", std::move(x), unary(), begin);
+            else if (eat("%"))
+                x = binary("%", std::move(x), unary(), begin);
+            else
+                return x;
+        }
+    }
+
+    ExprNodePtr sum()
+    {
+        skip_blanks();
+        size_t begin = _pos;
+        ExprNodePtr x = product();
+        for (;;) {
+            if (eat("+"))
+                x = binary("+", std::move(x), product(), begin);
+            else if (eat("-"))
+                x = binary("-", std::move(x), product(), begin);
+            else
+                return x;
+        }
+    }
+
+    ExprNodePtr comparison()
+    {
+        skip_blanks();
+        size_t begin = _pos;
+        ExprNodePtr x = sum();
+        static const char* ops[] = { "==", "!=", "<=", ">=", "<", ">" };
+        for (;;) {
+            size_t i = 0;
+            while (i < 6 && !eat(ops[i]))
+                i++;
+            if (i == 6)
+                return x;
+            x = binary(ops[i], std::move(x), sum(), begin);
+        }
+    }
+
+    ExprNodePtr logical_and()
+    {
+        skip_blanks();
+        size_t begin = _pos;
+        ExprNodePtr x = comparison();
+        while (eat("&&"))
+            x = binary("&&", std::move(x), comparison(), begin);
+        return x;
+    }
+
+    ExprNodePtr logical_or()
+    {
+        skip_blanks();
+        size_t begin = _pos;
+        ExprNodePtr x = logical_and();
+        while (eat("||"))
+            x = binary("||", std::move(x), logical_and(), begin);
+        return x;
+    }
+
+    ExprNodePtr conditional()
+    {
+        skip_blanks();
+        size_t begin = _pos;
+        ExprNodePtr x = logical_or();
+        if (eat("?")) {
+            ExprNodePtr n = node(ExprNode::Conditional, "?:", begin);
+            n->args.push_back(std::move(x));
+            n->args.push_back(conditional());
+            expect(":");
+            n->args.push_back(conditional());
+            return finish(std::move(n));
+        }
+        return x;
+    }
+
+    ExprNodePtr assignment()
+    {
+        skip_blanks();
+        size_t begin = _pos;
+        while (_pos < _expr.size() && (isalnum(static_cast<unsigned char>(_expr[_pos])) || _expr[_pos] == '_'))
+            _pos++;
+        std::string name = _expr.substr(begin, _pos - begin);
+        static const char* ops[] = { "+=", "-=", "*=", "/=", "=" };
+        if (!name.empty() && !isdigit(static_cast<unsigned char>(name[0]))) {
+            for (size_t i = 0; i < 5; i++) {
+                skip_blanks();
+                if (_expr.compare(_pos, strlen(ops[i]), ops[i]) == 0
+                        && (i < 4 || _expr.compare(_pos, 2, "==") != 0)) {
+                    _pos += strlen(ops[i]);
+                    ExprNodePtr n = node(ExprNode::Assignment, ops[i], begin);
+                    ExprNodePtr v = node(ExprNode::Variable, name, begin);
+                    v->end = begin + name.size();
+                    n->args.push_back(std::move(v));
+                    n->args.push_back(assignment());
+                    n->end = _pos;
+                    return n;
+                }
+            }
+        }
+        _pos = begin;
+        return conditional();
+    }
+
+public:
+    explicit ExprParser(const std::string& expr) : _expr(expr), _pos(0)
+    {
+    }
+
+    // Parse the comma-separated expressions; returns false for unsupported syntax
+    bool parse(std::vector<ExprNodePtr>& roots)
+    {
+        roots.clear();
+        try {
+            do
+                roots.push_back(assignment());
+            while (eat(","));
+            skip_blanks();
+            if (_pos != _expr.size())
+                throw Unsupported();
+        }
+        catch (Unsupported&) {
+            return false;
+        }
+        return true;
+    }
+};
+
+/* muparser evaluation of an expression and printing of result */
+
+// The origin of an expression, for error messages such as "Line 42: ...".
+// The message prefix is only formatted when an error occurs.
+struct ErrorContext
+{
+    const char* what;   // NULL for no prefix
+    size_t number;      // 0 for no number
+
+    ErrorContext(const char* w = NULL, size_t n = 0) : what(w), number(n)
+    {
+    }
+};
+
+static void format_error_prefix(const ErrorContext& context, Arena& arena)
+{
+    if (context.what) {
+        arena.append(context.what);
+        if (context.number > 0) {
+            arena.append(' ');
+            arena.append_number(context.number);
+        }
+        arena.append(": ");
+    }
+}
+
+static void format_results(const double* results, int n, Arena& arena)
+{
+    char buf[32];
+    for (int j = 0; j < n; j++) {
+        arena.append(buf, snprintf(buf, sizeof(buf), "%.12g%s", results[j], j == n - 1 ? "\n" : ", "));
+    }
+}
+
+static void format_error(const mu::Parser::exception_type& e,
+        const ErrorContext& context,
+        Arena& arena)
+{
+    // Fix up the exception before reporting the error
+    mu::string_type expr = e.GetExpr();
+    mu::string_type token = e.GetToken();
+    mu::EErrorCodes code = e.GetCode();
+    size_t pos = e.GetPos();
+    // Let positions start at 1 and fix position reported for EOF
+    if (code != mu::ecUNEXPECTED_EOF)
+        pos++;
+    if (pos == 0)
+        pos = 1;
+    // Remove excess blank from token
+    if (!token.empty() && token.back() == ' ')
+        token.pop_back();
+    mu::Parser::exception_type fixed_err(code, pos, token);
+    // Report the fixed error
+    format_error_prefix(context, arena);
+    arena.append(fixed_err.GetMsg());
+    arena.append('\n');
+    arena.append(expr);
+    arena.append('\n');
+    for (size_t i = 1; i < fixed_err.GetPos(); i++)
+        arena.append(' ');
+    arena.append("^\n");
+}
+
+/* fast path for huge literal lists */
+
+// Generated lines such as sum(...) or med(...) with a million numbers, or
+// plain lists of a million numbers, are evaluated in one streaming pass
+// instead of going through the muParser tokenizer and bytecode, whose time
+// and memory grow much faster with the length of such lines. Anything
+// that is not a plain number in such a line falls back to muParser.
+static const size_t huge_expr_length = 4096;
+
+static const char* skip_blanks(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    return p;
+}
+
+// Parse a number with optional sign in the syntax that muParser accepts
+static const char* parse_literal(const char* p, const char* end, double* value)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p = skip_blanks(p + 1, end);
+    }
+    const char* start = p;
+    while (p < end && ((*p >= '0' && *p <= '9') || *p == '.'))
+        p++;
+    if (p == start)
+        return NULL;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '-' || *p == '+'))
+            p++;
+        const char* exponent = p;
+        while (p < end && *p >= '0' && *p <= '9')
+            p++;
+        if (p == exponent)
+            return NULL;
+    }
+    // strtod() needs a terminated string, but the token is always followed
+    // by a character that it does not accept
+    char* number_end;
+    *value = strtod(start, &number_end);
+    if (number_end != p)
+        return NULL;
+    if (negative)
+        *value = -*value;
+    return p;
+}
+
+// A block of up to mucalc::sum_block_size values of a huge literal list
+struct HugeBlock
+{
+    size_t n;
+    double sum, min, max;
+};
+
+// Parse the values of one block, starting at p, and store them in values
+// unless it is NULL. Returns the position after the comma that follows the
+// last value of the block, end at the end of the list, or NULL if the list
+// is not a plain list of numbers.
+static const char* parse_huge_block(const char* p, const char* end, double* values, HugeBlock& block)
+{
+    block.n = 0;
+    block.sum = 0.0;
+    for (;;) {
+        double value;
+        p = parse_literal(skip_blanks(p, end), end, &value);
+        if (!p)
+            return NULL;
+        if (values)
+            values[block.n] = value;
+        block.sum += value;
+        if (block.n == 0 || value < block.min)
+            block.min = value;
+        if (block.n == 0 || value > block.max)
+            block.max = value;
+        block.n++;
+        p = skip_blanks(p, end);
+        if (p == end)
+            return p;
+        if (*p != ',')
+            return NULL;
+        p++;
+        if (block.n == mucalc::sum_block_size)
+            return p;
+    }
+}
+
+// Runs task(begin, end) on parts of [0, n), possibly in parallel
+typedef std::function<void(size_t n, const std::function<void(size_t, size_t)>& task)> ParallelFor;
+
+// Lists at least this long are parsed in parallel if possible
+static const size_t huge_parallel_length = 1 << 20;
+
+// Find the start of each block of the list from p to end in parallel, from
+// the positions of the commas
+static void find_huge_blocks(const char* p, const char* end, const ParallelFor& parallel_for,
+        std::vector<const char*>& block_starts)
+{
+    const size_t parts = 256;
+    size_t length = end - p;
+    std::vector<size_t> commas(parts + 1, 0);
+    parallel_for(parts, [&](size_t begin, size_t end_part) {
+        for (size_t i = begin; i < end_part; i++) {
+            const char* q = p + length * i / parts;
+            const char* q_end = p + length * (i + 1) / parts;
+            size_t count = 0;
+            while ((q = static_cast<const char*>(memchr(q, ',', q_end - q))) != NULL) {
+                count++;
+                q++;
+            }
+            commas[i + 1] = count;
+        }
+    });
+    for (size_t i = 0; i < parts; i++)
+        commas[i + 1] += commas[i];
+    // value k + 1 starts after comma k
+    size_t values = commas[parts] + 1;
+    block_starts.resize((values + mucalc::sum_block_size - 1) / mucalc::sum_block_size);
+    block_starts[0] = p;
+    parallel_for(parts, [&](size_t begin, size_t end_part) {
+        for (size_t i = begin; i < end_part; i++) {
+            const char* q = p + length * i / parts;
+            const char* q_end = p + length * (i + 1) / parts;
+            size_t k = commas[i];
+            while ((q = static_cast<const char*>(memchr(q, ',', q_end - q))) != NULL) {
+                q++;
+                k++;
+                if (k % mucalc::sum_block_size == 0)
+                    block_starts[k / mucalc::sum_block_size] = q;
+            }
+        }
+    });
+}
+
+// The results of a huge literal list
+struct HugeResult
+{
+    const double* values;       // the values of a list, or &result
+    size_t n;
+    double result;              // of sum(), min(), max(), avg(), or med()
+    bool rounded;               // whether result has rounding errors
+};
+
+// Returns false if the expression is not a huge literal list. The values of
+// a list stay valid until the next call on the same thread. If parallel_for
+// is set, long lists are parsed in parallel; the block structure of the sum
+// is the same, so the results are bit-identical for any number of threads.
+static bool eval_huge(const std::string& expr, HugeResult& r,
+        const ParallelFor& parallel_for = ParallelFor())
+{
+    if (expr.length() < huge_expr_length)
+        return false;
+    enum { List, Sum, Min, Max, Avg, Med } function;
+    const char* p = skip_blanks(expr.data(), expr.data() + expr.length());
+    const char* end = expr.data() + expr.length();
+    size_t name_length = 0;
+    while (p + name_length < end && isalpha(static_cast<unsigned char>(p[name_length])))
+        name_length++;
+    if (name_length == 0)
+        function = List;
+    else if (name_length == 3 && strncmp(p, "sum", 3) == 0)
+        function = Sum;
+    else if (name_length == 3 && strncmp(p, "min", 3) == 0)
+        function = Min;
+    else if (name_length == 3 && strncmp(p, "max", 3) == 0)
+        function = Max;
+    else if (name_length == 3 && strncmp(p, "avg", 3) == 0)
+        function = Avg;
+    else if (name_length == 3 && strncmp(p, "med", 3) == 0)
+        function = Med;
+    else
+        return false;
+    if (function != List) {
+        p = skip_blanks(p + name_length, end);
+        if (p == end || *p != '(')
+            return false;
+        p++;
+        // the closing parenthesis must be the last character
+        while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+            end--;
+        if (end == p || end[-1] != ')')
+            return false;
+        end--;
+    }
+
+    if (skip_blanks(p, end) == end)
+        return false;
+
+    // Only lists and med() need to keep the values
+    bool keep_values = (function == List || function == Med);
+    // the worker threads check the cancel flag of this thread
+    const std::atomic<bool>* cancel = eval_cancel_flag;
+    static thread_local std::vector<double> thread_values;
+    static thread_local std::vector<HugeBlock> thread_blocks;
+    // references, so that the worker threads use the vectors of this thread
+    std::vector<double>& values = thread_values;
+    std::vector<HugeBlock>& blocks = thread_blocks;
+    values.clear();
+    blocks.clear();
+    if (parallel_for && static_cast<size_t>(end - p) >= huge_parallel_length) {
+        std::vector<const char*> block_starts;
+        find_huge_blocks(p, end, parallel_for, block_starts);
+        size_t n = block_starts.size();
+        blocks.resize(n);
+        if (keep_values)
+            values.resize(n * mucalc::sum_block_size);
+        std::atomic<bool> ok(true);
+        parallel_for(n, [&](size_t begin, size_t end_block) {
+            for (size_t b = begin; b < end_block && ok; b++) {
+                if (cancel && cancel->load(std::memory_order_relaxed)) {
+                    ok = false;
+                    break;
+                }
+                const char* next = parse_huge_block(block_starts[b], end,
+                        keep_values ? &values[b * mucalc::sum_block_size] : NULL, blocks[b]);
+                if (next != (b + 1 < n ? block_starts[b + 1] : end))
+                    ok = false;
+            }
+        });
+        if (!ok)
+            return false;
+        if (keep_values)
+            values.resize((n - 1) * mucalc::sum_block_size + blocks[n - 1].n);
+    } else {
+        while (p != end) {
+            if (eval_canceled())
+                return false;
+            size_t offset = values.size();
+            if (keep_values)
+                values.resize(offset + mucalc::sum_block_size);
+            HugeBlock block;
+            p = parse_huge_block(p, end, keep_values ? &values[offset] : NULL, block);
+            if (!p)
+                return false;
+            if (keep_values)
+                values.resize(offset + block.n);
+            blocks.push_back(block);
+        }
+    }
+
+    size_t n = 0;
+    std::vector<double> block_sums(blocks.size());
+    double min = blocks[0].min, max = blocks[0].max;
+    for (size_t b = 0; b < blocks.size(); b++) {
+        n += blocks[b].n;
+        block_sums[b] = blocks[b].sum;
+        min = std::min(min, blocks[b].min);
+        max = std::max(max, blocks[b].max);
+    }
+    double sum = mucalc::pairwise_sum(block_sums.data(), block_sums.size());
+
+    switch (function) {
+    case List:
+        r.values = values.data();
+        r.n = values.size();
+        r.rounded = false;
+        return true;
+    case Sum:
+        r.result = sum;
+        break;
+    case Min:
+        r.result = min;
+        break;
+    case Max:
+        r.result = max;
+        break;
+    case Avg:
+        r.result = sum / n;
+        break;
+    default:
+        r.result = mucalc::med(values.data(), values.size());
+        break;
+    }
+    r.values = &r.result;
+    r.n = 1;
+    r.rounded = (function == Sum || function == Avg);
+    return true;
+}
+
+/* precision check */
+
+// With --check-precision, expressions without side effects are evaluated
+// with rounding upward and downward as well, which estimates the rounding
+// error of the result cheaply. This is an estimate, not a bound: the errors
+// of the directed evaluations can cancel, and functions like sin() ignore
+// the rounding mode. Only if the estimate affects the printed digits, for
+// example after cancellation, the expression is evaluated again in long
+// double precision. If that does not help either, only the reliable digits
+// are printed, followed by the error estimate.
+// Where long double is just double (MSVC, AArch64 on Apple and others), the
+// long double evaluation cannot be more precise and is skipped.
+// Huge literal lists and column mode are checked as well (see
+// format_checked_huge() and eval_row()); long expression lists are then
+// evaluated by the main parser instead of in parallel.
+static bool check_precision = false;
+static const bool precise_evaluation = (LDBL_MANT_DIG > DBL_MANT_DIG);
+
+// Evaluator for expression trees in long double precision. It reads the
+// variables of the parser but does not support assignments or functions with
+// side effects; eval() returns false for everything it does not support.
+class PreciseEvaluator
+{
+private:
+    typedef long double real;
+    struct Unsupported {};
+
+    const mu::varmap_type& _vars;
+    const std::string& _expr;
+    std::vector<ExprNodePtr> _roots;
+    bool _parsed;
+
+    static real mod(real x, real y)
+    {
+        return x - y * std::floor(x / y);
+    }
+
+    static real clamp(real x, real minval, real maxval)
+    {
+        return std::min(maxval, std::max(minval, x));
+    }
+
+    static real call(const std::string& name, std::vector<real>& a)
+    {
+        const real pi = 3.1415926535897932384626433832795029L;
+        size_t n = a.size();
+        if (n == 1) {
+            real x = a[0];
+            if (name == "sin") return std::sin(x);
+            if (name == "cos") return std::cos(x);
+            if (name == "tan") return std::tan(x);
+            if (name == "asin") return std::asin(x);
+            if (name == "acos") return std::acos(x);
+            if (name == "atan") return std::atan(x);
+            if (name == "sinh") return std::sinh(x);
+            if (name == "cosh") return std::cosh(x);
+            if (name == "tanh") return std::tanh(x);
+            if (name == "asinh") return std::asinh(x);
+            if (name == "acosh") return std::acosh(x);
+            if (name == "atanh") return std::atanh(x);
+            if (name == "exp") return std::exp(x);
+            if (name == "exp2") return std::exp2(x);
+            if (name == "log" || name == "ln") return std::log(x);
+            if (name == "log2") return std::log2(x);
+            if (name == "log10") return std::log10(x);
+            if (name == "sqrt") return std::sqrt(x);
+            if (name == "cbrt") return std::cbrt(x);
+            if (name == "abs") return std::fabs(x);
+            if (name == "sign") return (x < 0 ? -1 : x > 0 ? 1 : 0);
+            if (name == "fract") return x - std::floor(x);
+            if (name == "int") return static_cast<int>(x);
+            if (name == "ceil") return std::ceil(x);
+            if (name == "floor") return std::floor(x);
+            if (name == "round") return std::round(x);
+            if (name == "rint") return std::rint(x);
+            if (name == "trunc") return std::trunc(x);
+            if (name == "deg") return x * 180 / pi;
+            if (name == "rad") return x * pi / 180;
+            if (name == "erf") return std::erf(x);
+            if (name == "erfc") return std::erfc(x);
+            if (name == "tgamma") return std::tgamma(x);
+            if (name == "lgamma") return mucalc::lgamma(x);
+            if (name == "normcdf") return std::erfc(-x / std::sqrt(2.0L)) / 2;
+        } else if (n == 2) {
+            if (name == "atan2") return std::atan2(a[0], a[1]);
+            if (name == "pow") return std::pow(a[0], a[1]);
+            if (name == "step") return (a[0] < a[1] ? 0 : 1);
+            if (name == "beta" && a[0] > 0 && a[1] > 0)
+                return std::exp(mucalc::lgamma(a[0]) + mucalc::lgamma(a[1]) - mucalc::lgamma(a[0] + a[1]));
+            if (name == "beta") return std::tgamma(a[0]) * std::tgamma(a[1]) / std::tgamma(a[0] + a[1]);
+        } else if (n == 3) {
+            if (name == "clamp")
+                return clamp(a[0], a[1], a[2]);
+            if (name == "smoothstep") {
+                real t = clamp((a[0] - a[1]) / (a[2] - a[1]), 0, 1);
+                return t * t * (3 - t * 2);
+            }
+            if (name == "mix")
+                return a[0] * (1 - a[2]) + a[1] * a[2];
+        }
+        if (n >= 1) {
+            if (name == "sum" || name == "avg") {
+                real s = mucalc::ordered_sum(a.data(), n);
+                return (name == "sum" ? s : s / n);
+            }
+            if (name == "min")
+                return *std::min_element(a.begin(), a.end());
+            if (name == "max")
+                return *std::max_element(a.begin(), a.end());
+            if (name == "med") {
+                std::sort(a.begin(), a.end());
+                return (n % 2 == 1 ? a[n / 2] : (a[n / 2 - 1] + a[n / 2]) / 2);
+            }
+        }
+        throw Unsupported();
+    }
+
+    real eval_node(const ExprNode& n)
+    {
+        switch (n.kind) {
+        case ExprNode::Constant:
+            if (n.name == "pi")
+                return 3.1415926535897932384626433832795029L;
+            if (n.name == "e")
+                return 2.7182818284590452353602874713526625L;
+            return strtold(_expr.c_str() + n.begin, NULL);
+        case ExprNode::Variable: {
+            mu::varmap_type::const_iterator it = _vars.find(n.name);
+            if (it == _vars.end())
+                throw Unsupported();
+            return *(it->second);
+        }
+        case ExprNode::Operator: {
+            real x = eval_node(*n.args[0]);
+            if (n.args.size() == 1)
+                return -x;
+            real y = eval_node(*n.args[1]);
+            const std::string& op = n.name;
+            if (op == "+") return x + y;
+            if (op == "-") return x - y;
+            if (op == "*") return x * y;
+            if (op == "/") return x / y;
+            if (op == "%") return mod(x, y);
+            if (op == "^") return std::pow(x, y);
+            if (op == "==") return (x == y);
+            if (op == "!=") return (x != y);
+            if (op == "<=") return (x <= y);
+            if (op == ">=") return (x >= y);
+            if (op == "<") return (x < y);
+            if (op == ">") return (x > y);
+            if (op == "&&") return (x != 0 && y != 0);
+            if (op == "||") return (x != 0 || y != 0);
+            throw Unsupported();
+        }
+        case ExprNode::Conditional:
+            return (eval_node(*n.args[0]) != 0 ? eval_node(*n.args[1]) : eval_node(*n.args[2]));
+        case ExprNode::Function: {
+            std::vector<real> args(n.args.size());
+            for (size_t i = 0; i < n.args.size(); i++)
+                args[i] = eval_node(*n.args[i]);
+            return call(n.name, args);
+        }
+        default:
+            throw Unsupported(); // strings and assignments
+        }
+    }
+
+public:
+    PreciseEvaluator(const mu::varmap_type& vars, const std::string& expr) : _vars(vars), _expr(expr)
+    {
+        ExprParser parser(expr);
+        _parsed = parser.parse(_roots);
+    }
+
+    bool eval(std::vector<real>& results)
+    {
+        results.clear();
+        if (!_parsed)
+            return false;
+        try {
+            for (size_t i = 0; i < _roots.size(); i++)
+                results.push_back(eval_node(*_roots[i]));
+        }
+        catch (Unsupported&) {
+            return false;
+        }
+        return true;
+    }
+};
+
+// Largest difference of the results under upward and downward rounding
+template<typename T>
+static void rounding_error_estimate(const std::vector<T>& nearest,
+        const std::vector<T>& upward, const std::vector<T>& downward,
+        std::vector<T>& error)
+{
+    error.resize(nearest.size());
+    for (size_t i = 0; i < nearest.size(); i++) {
+        error[i] = std::max(std::fabs(upward[i] - nearest[i]), std::fabs(downward[i] - nearest[i]));
+        if (std::isnan(error[i]))
+            error[i] = 0; // NaN and infinities do not have reliable digits anyway
+    }
+}
+
+// Whether the error affects the 12 printed significant digits
+template<typename T>
+static bool is_reliable(T value, T error)
+{
+    return (error <= std::fabs(value) * 5e-13L);
+}
+
+// Print the value with the digits that the error estimate leaves intact
+static void format_checked_value(double value, double error, const char* separator, Arena& arena)
+{
+    char buf[64];
+    if (is_reliable(value, error)) {
+        arena.append(buf, snprintf(buf, sizeof(buf), "%.12g%s", value, separator));
+    } else {
+        int digits = (error > 0 && value != 0
+                ? static_cast<int>(std::floor(std::log10(std::fabs(value) / error))) : 1);
+        digits = std::max(1, std::min(12, digits));
+        arena.append(buf, snprintf(buf, sizeof(buf), "%.*g (+/-%.2g)%s",
+                    digits, value, error, separator));
+    }
+}
+
+// Evaluate the expression twice more with directed rounding and format the
+// results of the first evaluation accordingly. May throw parser errors.
+static void format_checked_results(mu::Parser& parser, const std::string& expr,
+        const double* results, int n, Arena& arena, double* first_result)
+{
+    std::vector<double> nearest(results, results + n), upward, downward;
+    const int modes[2] = { FE_UPWARD, FE_DOWNWARD };
+    std::vector<double>* directed[2] = { &upward, &downward };
+    for (int m = 0; m < 2; m++) {
+        fesetround(modes[m]);
+        try {
+            parser.SetExpr(expr);
+            int k;
+            double* r = parser.Eval(k);
+            directed[m]->assign(r, r + std::min(k, n));
+        }
+        catch (...) {
+            fesetround(FE_TONEAREST);
+            throw;
+        }
+        fesetround(FE_TONEAREST);
+    }
+    parser.SetExpr(expr); // do not keep constants folded with directed rounding
+    std::vector<double> error;
+    rounding_error_estimate(nearest, upward, downward, error);
+    bool reliable = true;
+    for (int i = 0; i < n; i++)
+        reliable = reliable && is_reliable(nearest[i], error[i]);
+
+    std::vector<long double> precise[3], precise_error;
+    if (!reliable && precise_evaluation) {
+        PreciseEvaluator evaluator(parser.GetVar(), expr);
+        const int precise_modes[3] = { FE_TONEAREST, FE_UPWARD, FE_DOWNWARD };
+        bool ok = true;
+        for (int m = 0; m < 3 && ok; m++) {
+            fesetround(precise_modes[m]);
+            ok = evaluator.eval(precise[m]) && precise[m].size() == nearest.size();
+            fesetround(FE_TONEAREST);
+        }
+        if (ok)
+            rounding_error_estimate(precise[0], precise[1], precise[2], precise_error);
+    }
+
+    char buf[64];
+    for (int i = 0; i < n; i++) {
+        const char* separator = (i == n - 1 ? "\n" : ", ");
+        double value = nearest[i];
+        double value_error = error[i];
+        if (!precise_error.empty() && precise_error[i] < error[i]) {
+            value = precise[0][i];
+            value_error = precise_error[i];
+            if (is_reliable(precise[0][i], precise_error[i])) {
+                arena.append(buf, snprintf(buf, sizeof(buf), "%.12Lg%s", precise[0][i], separator));
+                nearest[i] = value;
+                continue;
+            }
+        }
+        nearest[i] = value;
+        format_checked_value(value, value_error, separator, arena);
+    }
+    if (n > 0)
+        *first_result = nearest[0];
+}
+
+// Sums and averages of huge literal lists are computed again with directed
+// rounding, without a long double evaluation. This is done on the calling
+// thread only, since the rounding mode is a per-thread setting.
+static void format_checked_huge(const std::string& expr, const HugeResult& huge, Arena& arena)
+{
+    if (!huge.rounded) {
+        format_results(huge.values, huge.n, arena);
+        return;
+    }
+    double error = 0.0;
+    const int modes[2] = { FE_UPWARD, FE_DOWNWARD };
+    for (int m = 0; m < 2; m++) {
+        HugeResult directed;
+        fesetround(modes[m]);
+        bool ok = eval_huge(expr, directed);
+        fesetround(FE_TONEAREST);
+        if (ok)
+            error = std::max(error, std::fabs(directed.result - huge.result));
+    }
+    if (std::isnan(error))
+        error = 0.0;
+    format_checked_value(huge.result, error, "\n", arena);
+}
+
+// Parallel evaluation of long expression lists, see below
+class ListEvaluator;
+static ParallelFor list_parallel_for(ListEvaluator* list_evaluator);
+static bool list_eval(ListEvaluator* list_evaluator, const mu::Parser& parser,
+        const std::string& expr, Arena& arena, double* first_result);
+
+// Evaluate the expression and append its results (on success) or error
+// messages (on failure) to the arena instead of printing them, so that
+// evaluation threads can work independently of the output order. Huge
+// literal lists take the fast path, and with a list evaluator, long
+// expression lists are evaluated in parallel if possible.
+static int eval(mu::Parser& parser,
+        double* last_result,
+        const std::string& expr,
+        const ErrorContext& context,
+        Arena& arena,
+        ListEvaluator* list_evaluator = NULL)
+{
+    int retval = 0;
+    HugeResult huge;
+    if (eval_huge(expr, huge, list_parallel_for(list_evaluator))) {
+        if (check_precision)
+            format_checked_huge(expr, huge, arena);
+        else
+            format_results(huge.values, huge.n, arena);
+        *last_result = huge.values[0];
+        return 0;
+    }
+    // The precision check is done by the main parser
+    double result;
+    if (!check_precision && list_eval(list_evaluator, parser, expr, arena, &result)) {
+        *last_result = result;
+        return 0;
+    }
+    try {
+        check_canceled();
+        parser.SetExpr(expr);
+        int n;
+        double* results = parser.Eval(n);
+        bool check = false;
+        if (check_precision) {
+            // evaluating again must not have side effects
+            ExprInfo info = analyze_expr(expr);
+            check = !info.has_assignment && !info.uses_impure_functions;
+        }
+        if (check) {
+            format_checked_results(parser, expr, results, n, arena, last_result);
+        } else {
+            format_results(results, n, arena);
+            if (n > 0) {
+                *last_result = results[0];
+            }
+        }
+    }
+    catch (mu::Parser::exception_type& e) {
+        format_error(e, context, arena);
+        retval = 1;
+    }
+    return retval;
+}
+
+/* readline custom completion */
+
+char* xstrdup(const char *s)
+{
+    char* p = strdup(s);
+    if (!p) {
+        fputs(strerror(ENOMEM), stderr);
+        fputc('\n', stderr);
+        exit(1);
+    }
+    return p;
+}
+
+static char* completion_generator(const char* text, int state)
+{
+    static int functions_index, constants_index, variables_index, len;
+    if (state == 0) {
+        functions_index = 0;
+        constants_index = 0;
+        variables_index = 0;
+        len = strlen(text);
+    }
+
+    const char* name;
+    // first complete function names...
+    while ((name = function_names[functions_index])) {
+        functions_index++;
+        if (strncmp(name, text, len) == 0)
+            break;
+    }
+    if (name) {
+        rl_completion_append_character = '(';
+        return xstrdup(name);
+    }
+    // ... then constant names...
+    while ((name = constant_names[constants_index])) {
+        constants_index++;
+        if (strncmp(name, text, len) == 0)
+            break;
+    }
+    if (name) {
+        rl_completion_append_character = ' ';
+        return xstrdup(name);
+    }
+    // ... and finally variable names, unless a running evaluation might
+    // currently be adding variables.
+    std::unique_lock<std::mutex> lock(added_vars_mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+        return NULL;
+    while (static_cast<size_t>(variables_index) < added_vars.size()) {
+        name = added_vars[variables_index].first.c_str();
+        variables_index++;
+        if (strncmp(name, text, len) == 0)
+            break;
+        name = NULL;
+    }
+    if (name) {
+        rl_completion_append_character = ' ';
+        return xstrdup(name);
+    }
+    return NULL;
+}
+
+/* readline history file location */
+
+std::string history_file()
+{
+    static std::string histfile;
+    if (histfile.empty()) {
+#if defined(_WIN32) || defined(_WIN64)
+        const char* appdata = getenv("APPDATA");
+        if (appdata)
+            histfile = std::string(appdata) + '\\';
+        histfile += "mucalc_history.txt";
+#else
+        const char* home = getenv("HOME");
+        if (home)
+            histfile = std::string(home) + '/';
+        histfile += ".mucalc_history";
+#endif
+    }
+    return histfile;
+}
+
+/* work-stealing scheduler for parallel evaluation */
+
+// The items of a task are split into chunks that are distributed to one queue
+// per thread. Each thread works through its own queue from the front and
+// steals chunks from the back of other queues when it runs out of work, so
+// that threads do not sit idle when some items are much more expensive than
+// others. The calling thread takes part as thread 0. With pinning, the worker
+// threads are pinned to CPUs; the calling thread is left alone since it also
+// does other work, such as reading input.
+class Scheduler
+{
+public:
+    // A task processes the items [begin, end) on the thread with the given index
+    typedef std::function<void (size_t begin, size_t end, int thread_index)> Task;
+
+private:
+    struct Chunk
+    {
+        size_t begin, end;
+    };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Chunk> chunks;
+    };
+
+    int _thread_count;
+    int _active_threads;
+    std::vector<int> _cpus; // CPUs that threads are pinned to, empty if unpinned
+    std::vector<std::unique_ptr<Queue>> _queues;
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _start_cond;
+    std::condition_variable _done_cond;
+    const Task* _task;
+    unsigned long _generation;
+    int _busy_threads;
+    bool _quit;
+
+    bool get_chunk(int thread_index, Chunk& chunk)
+    {
+        // first work on our own queue...
+        {
+            Queue& queue = *_queues[thread_index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.chunks.empty()) {
+                chunk = queue.chunks.front();
+                queue.chunks.pop_front();
+                return true;
+            }
+        }
+        // ... then steal from the others.
+        for (int i = 1; i < _active_threads; i++) {
+            Queue& queue = *_queues[(thread_index + i) % _active_threads];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.chunks.empty()) {
+                chunk = queue.chunks.back();
+                queue.chunks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(int thread_index)
+    {
+        Chunk chunk;
+        while (get_chunk(thread_index, chunk))
+            (*_task)(chunk.begin, chunk.end, thread_index);
+    }
+
+    void pin(int thread_index)
+    {
+#ifdef __linux__
+        if (_cpus.size() > 0) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(_cpus[thread_index % _cpus.size()], &cpuset);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+        }
+#else
+        (void)thread_index;
+#endif
+    }
+
+    void thread_main(int thread_index)
+    {
+        pin(thread_index);
+        init_prng(thread_index);
+        unsigned long generation = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _start_cond.wait(lock, [&]() { return _quit || _generation != generation; });
+                if (_quit)
+                    break;
+                generation = _generation;
+            }
+            if (thread_index < _active_threads)
+                work(thread_index);
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (--_busy_threads == 0)
+                    _done_cond.notify_one();
+            }
+        }
+    }
+
+public:
+    Scheduler(int thread_count, bool pin_threads) :
+        _thread_count(std::max(thread_count, 1)),
+        _active_threads(_thread_count),
+        _task(NULL), _generation(0), _busy_threads(0), _quit(false)
+    {
+#ifdef __linux__
+        if (pin_threads) {
+            cpu_set_t cpuset;
+            if (sched_getaffinity(0, sizeof(cpuset), &cpuset) == 0) {
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                    if (CPU_ISSET(cpu, &cpuset))
+                        _cpus.push_back(cpu);
+            }
+        }
+#else
+        if (pin_threads)
+            fprintf(stderr, "Pinning threads is not supported on this platform\n");
+#endif
+        for (int i = 0; i < _thread_count; i++)
+            _queues.emplace_back(new Queue);
+        for (int i = 1; i < _thread_count; i++)
+            _threads.push_back(std::thread(&Scheduler::thread_main, this, i));
+    }
+
+    ~Scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _quit = true;
+        }
+        _start_cond.notify_all();
+        for (size_t i = 0; i < _threads.size(); i++)
+            _threads[i].join();
+    }
+
+    int thread_count() const
+    {
+        return _thread_count;
+    }
+
+    // Run the task on the items [0, n) in chunks of the given size and
+    // return when all items are processed. Only the first active_threads
+    // threads take part (0 means all threads).
+    void run(size_t n, size_t chunk_size, const Task& task, int active_threads = 0)
+    {
+        if (n == 0)
+            return;
+        chunk_size = std::max(chunk_size, static_cast<size_t>(1));
+        if (active_threads <= 0 || active_threads > _thread_count)
+            active_threads = _thread_count;
+        // Give each queue a contiguous block of chunks. The other threads
+        // are idle at this point, so the queues need no locking.
+        size_t chunk_count = (n + chunk_size - 1) / chunk_size;
+        for (size_t c = 0; c < chunk_count; c++) {
+            Chunk chunk = { c * chunk_size, std::min(n, (c + 1) * chunk_size) };
+            _queues[c * active_threads / chunk_count]->chunks.push_back(chunk);
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _task = &task;
+            _active_threads = active_threads;
+            _busy_threads = _thread_count - 1;
+            _generation++;
+        }
+        _start_cond.notify_all();
+        work(0);
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done_cond.wait(lock, [&]() { return _busy_threads == 0; });
+        _task = NULL;
+    }
+};
+
+/* parallel evaluation of standard input */
+
+// A variable that is sampled at n points from first to last in grid mode
+struct GridAxis
+{
+    std::string name;
+    double first, last;
+    size_t n;
+
+    double at(size_t i) const
+    {
+        return (n > 1 ? first + (last - first) * i / (n - 1) : first);
+    }
+};
+
+struct Options
+{
+    int min_threads, max_threads;     // range of evaluation thread counts
+    bool threads_set;                 // whether --threads was given
+    bool pin_threads;                 // whether to pin threads to CPUs
+    size_t min_batch_size;            // range of lines per batch
+    size_t max_batch_size;
+    std::vector<std::string> columns; // variable names for column mode
+    int output_shards;                // number of output shard files, 0 for stdout
+    std::string output_pattern;       // shard file name pattern containing %d
+    bool preview;                     // live preview in interactive mode
+    std::vector<GridAxis> grid;       // x and y axis for grid mode
+    std::vector<std::pair<std::string, std::string>> npy_columns; // variable and .npy file names
+    std::string output_file;          // raster file in grid mode, .npy file in .npy mode
+
+    Options() :
+        min_threads(1), max_threads(1), threads_set(false), pin_threads(false),
+        min_batch_size(4096), max_batch_size(4096),
+        output_shards(0), preview(false)
+    {
+    }
+
+    // Grid and .npy mode use all cores unless --threads is given
+    int bulk_threads() const
+    {
+        return (threads_set ? max_threads : static_cast<int>(std::max(1u, std::thread::hardware_concurrency())));
+    }
+};
+
+/* automatic tuning of batch size and thread count */
+
+// The best batch size depends on the cost of the expressions, the cache sizes
+// and the cost of the output, and using more threads does not always help.
+// The tuner therefore measures the throughput of candidate configurations on
+// the first batches of a run: first the batch sizes (with all threads), then
+// the thread counts (with the best batch size). The best configuration is
+// used for the remaining input.
+class BatchTuner
+{
+private:
+    std::vector<size_t> _batch_sizes;
+    std::vector<int> _thread_counts;
+    int _phase;                 // 0: batch sizes, 1: thread counts, 2: done
+    size_t _candidate;          // index of the candidate currently measured
+    size_t _batch_size;         // current configuration
+    int _threads;
+    size_t _measured_lines;     // measurement of the current candidate
+    double _measured_seconds;
+    double _best_throughput;    // best candidate in the current phase
+    size_t _best_candidate;
+    double _tuning_seconds;     // total time spent tuning so far
+
+    static constexpr double min_measure_seconds = 0.02;
+    static constexpr double max_tuning_seconds = 2.0;
+
+    void start_candidate()
+    {
+        if (_phase == 0)
+            _batch_size = _batch_sizes[_candidate];
+        else if (_phase == 1)
+            _threads = _thread_counts[_candidate];
+        _measured_lines = 0;
+        _measured_seconds = 0.0;
+    }
+
+    void finish_phase()
+    {
+        if (_phase == 0)
+            _batch_size = _batch_sizes[_best_candidate];
+        else
+            _threads = _thread_counts[_best_candidate];
+        _phase++;
+        _candidate = 0;
+        _best_throughput = 0.0;
+        _best_candidate = 0;
+        if (_phase == 1 && _thread_counts.size() == 1)
+            _phase++;
+        if (_phase == 1)
+            start_candidate();
+    }
+
+public:
+    BatchTuner(const Options& options) :
+        _phase(0), _candidate(0),
+        _batch_size(options.max_batch_size), _threads(options.max_threads),
+        _measured_lines(0), _measured_seconds(0.0),
+        _best_throughput(0.0), _best_candidate(0),
+        _tuning_seconds(0.0)
+    {
+        for (size_t b = options.min_batch_size; b < options.max_batch_size; b *= 4)
+            _batch_sizes.push_back(b);
+        _batch_sizes.push_back(options.max_batch_size);
+        for (int t = options.max_threads; t > options.min_threads; t /= 2)
+            _thread_counts.push_back(t);
+        _thread_counts.push_back(options.min_threads);
+        if (_batch_sizes.size() == 1) {
+            _phase = 1;
+            _batch_size = _batch_sizes[0];
+            if (_thread_counts.size() == 1)
+                _phase = 2;
+        }
+        if (_phase < 2)
+            start_candidate();
+    }
+
+    bool tuning() const
+    {
+        return _phase < 2;
+    }
+
+    size_t batch_size() const
+    {
+        return _batch_size;
+    }
+
+    int threads() const
+    {
+        return _threads;
+    }
+
+    // Report the time it took to evaluate and print a batch
+    void report(size_t lines, double seconds)
+    {
+        if (_phase >= 2)
+            return;
+        _measured_lines += lines;
+        _measured_seconds += seconds;
+        _tuning_seconds += seconds;
+        bool out_of_time = (_tuning_seconds >= max_tuning_seconds);
+        if (_measured_seconds < min_measure_seconds && !out_of_time)
+            return;
+        double throughput = _measured_lines / std::max(_measured_seconds, 1e-9);
+        if (throughput > _best_throughput) {
+            _best_throughput = throughput;
+            _best_candidate = _candidate;
+        }
+        size_t candidates = (_phase == 0 ? _batch_sizes.size() : _thread_counts.size());
+        if (out_of_time) {
+            finish_phase();
+            if (_phase == 1)
+                finish_phase();
+        } else if (++_candidate < candidates) {
+            start_candidate();
+        } else {
+            finish_phase();
+        }
+    }
+};
+
+/* profiling */
+
+// Statistics that are printed to stderr at the end of a run with --profile
+struct Profile
+{
+    bool enabled;
+    std::chrono::steady_clock::time_point start;
+    size_t lines;
+    size_t batches;
+    size_t arena_bytes; // largest amount of arena memory used by a batch
+
+    Profile() : enabled(false), lines(0), batches(0), arena_bytes(0)
+    {
+    }
+
+    static double seconds_since(std::chrono::steady_clock::time_point t)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+    }
+
+    void print() const
+    {
+        if (!enabled)
+            return;
+        double seconds = seconds_since(start);
+        fprintf(stderr, "Profile: %zu lines in %.6f seconds (%.0f lines/s)\n",
+                lines, seconds, lines / std::max(seconds, 1e-9));
+        if (batches > 0)
+            fprintf(stderr, "Profile: %zu batches, up to %zu bytes of arena memory per batch\n",
+                    batches, arena_bytes);
+#ifdef MUCALC_COUNT_ALLOCATIONS
+        size_t heap = heap_allocations.load();
+        fprintf(stderr, "Profile: %zu heap allocations of %zu bytes (%.2f per line), %zu arena allocations\n",
+                heap, heap_bytes.load(), static_cast<double>(heap) / std::max(lines, static_cast<size_t>(1)),
+                Arena::allocations.load());
+#else
+        fprintf(stderr, "Profile: %zu arena allocations\n", Arena::allocations.load());
+#endif
+        size_t explicit_huge_bytes = large_alloc_stats.explicit_huge_bytes.load();
+        size_t transparent_requested_bytes = large_alloc_stats.transparent_requested_bytes.load();
+        size_t normal_bytes = large_alloc_stats.normal_bytes.load();
+        if (explicit_huge_bytes + transparent_requested_bytes + normal_bytes > 0) {
+            fprintf(stderr, "Profile: large buffers: %zu kB in explicit %zu kB pages, "
+                    "%zu kB with transparent huge pages requested, %zu kB on the heap\n",
+                    explicit_huge_bytes / 1024, huge_page_size() / 1024,
+                    transparent_requested_bytes / 1024, normal_bytes / 1024);
+        }
+#ifdef __linux__
+        // A request is only a hint; report how much memory of the process
+        // actually is in transparent huge pages
+        FILE* f = fopen("/proc/self/smaps_rollup", "r");
+        if (f) {
+            char line[128];
+            unsigned long kb;
+            while (fgets(line, sizeof(line), f)) {
+                if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+                    fprintf(stderr, "Profile: %lu kB obtained in transparent huge pages\n", kb);
+                    break;
+                }
+            }
+            fclose(f);
+        }
+#endif
+    }
+};
+
+static Profile profile;
+
+// The evaluation state of one thread
+struct Evaluator
+{
+    mu::Parser parser;
+    VarList vars;
+    double last_result;
+    std::vector<double> columns;
+    int hidden_results;     // column mode: leading results that are not printed
+    bool check_precision;   // column mode: whether the results are checked
+    Arena arena;
+
+    Evaluator() : last_result(0.0), hidden_results(0), check_precision(false)
+    {
+        init_parser(parser, &vars, &last_result);
+    }
+};
+
+struct Line
+{
+    size_t number;
+    std::string text;   // reused across batches to avoid allocations
+    bool independent;
+    int status;
+    double result;
+    int arena_index;    // results or errors, depending on status
+    ArenaText output;
+};
+
+// A line is independent of all other lines if it does not use or assign
+// variables and does not call impure functions. Such lines can be evaluated
+// in any order and on any thread.
+static bool is_independent(const std::string& line)
+{
+    ExprInfo info = analyze_expr(line);
+    return !info.uses_variables && !info.uses_impure_functions;
+}
+
+// Evaluate the column mode expressions for the row of values in line.text
+static void eval_row(Evaluator& evaluator, Line& line, int arena_index)
+{
+    Arena& arena = evaluator.arena;
+    line.arena_index = arena_index;
+    line.output.offset = arena.size();
+    line.status = 1;
+    const char* p = line.text.c_str();
+    size_t c = 0;
+    for (; c < evaluator.columns.size(); c++) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        char* end;
+        evaluator.columns[c] = strtod(p, &end);
+        if (end == p)
+            break;
+        p = end;
+    }
+    while (*p == ' ' || *p == '\t' || *p == ',' || *p == '\r')
+        p++;
+    if (c < evaluator.columns.size() || *p) {
+        format_error_prefix(ErrorContext("Line", line.number), arena);
+        arena.append("expected ");
+        arena.append_number(evaluator.columns.size());
+        arena.append(" values\n");
+    } else {
+        try {
+            int n;
+            double* results = evaluator.parser.Eval(n);
+            if (evaluator.check_precision) {
+                // the expressions are not fused in this case
+                std::string expr = evaluator.parser.GetExpr();
+                format_checked_results(evaluator.parser, expr, results, n, arena, &line.result);
+            } else {
+                format_results(results + evaluator.hidden_results, n - evaluator.hidden_results, arena);
+                line.result = results[evaluator.hidden_results];
+            }
+            evaluator.last_result = line.result;
+            line.status = 0;
+        }
+        catch (mu::Parser::exception_type& e) {
+            format_error(e, ErrorContext("Line", line.number), arena);
+        }
+    }
+    line.output.length = arena.size() - line.output.offset;
+}
+
+static void eval_line(mu::Parser& parser, Arena& arena, int arena_index, Line& line)
+{
+    line.arena_index = arena_index;
+    line.output.offset = arena.size();
+    line.status = eval(parser, &line.result, line.text, ErrorContext("Line", line.number), arena);
+    line.output.length = arena.size() - line.output.offset;
+}
+
+// Print the results or errors of a line. When results go to shard files,
+// only errors are printed.
+static void print_line(const Line& line, const std::vector<std::unique_ptr<Evaluator>>& evaluators,
+        bool print_results, double* last_result, int* retval)
+{
+    const Arena& arena = evaluators[line.arena_index]->arena;
+    if (line.status != 0 || print_results)
+        fwrite(arena.data(line.output.offset), 1, line.output.length, line.status == 0 ? stdout : stderr);
+    if (line.status == 0)
+        *last_result = line.result;
+    *retval = line.status;
+}
+
+/* parallel evaluation of comma-separated expression lists */
+
+// Long lines with several comma-separated expressions, e.g. many large med()
+// or sum() calls, are split at the top-level commas and the parts are
+// evaluated concurrently by worker parsers that share the variables of the
+// main parser. This is only done if the parts do not assign variables or
+// call impure functions; in all other cases, and if any part fails (so that
+// error positions refer to the full line), the line is evaluated by the main
+// parser as usual.
+class ListEvaluator
+{
+private:
+    Scheduler _scheduler;
+    std::vector<std::unique_ptr<Evaluator>> _evaluators;
+    std::vector<std::string> _parts;
+    std::vector<double> _results;
+    std::vector<char> _ok;
+
+    static void split(const std::string& expr, std::vector<std::string>& parts)
+    {
+        parts.clear();
+        int depth = 0;
+        size_t start = 0;
+        bool in_string = false;
+        for (size_t i = 0; i < expr.length(); i++) {
+            if (expr[i] == '"') {
+                in_string = !in_string;
+            } else if (in_string) {
+                continue;
+            } else if (expr[i] == '(') {
+                depth++;
+            } else if (expr[i] == ')') {
+                depth--;
+            } else if (expr[i] == ',' && depth == 0) {
+                parts.push_back(expr.substr(start, i - start));
+                start = i + 1;
+            }
+        }
+        parts.push_back(expr.substr(start));
+    }
+
+public:
+    // Shorter lines are not worth the overhead
+    static const size_t min_length = 1000;
+
+    ListEvaluator(int threads, bool pin_threads) : _scheduler(threads, pin_threads)
+    {
+        for (int t = 0; t < _scheduler.thread_count(); t++)
+            _evaluators.emplace_back(new Evaluator);
+    }
+
+    ParallelFor parallel_for()
+    {
+        return [this](size_t n, const std::function<void(size_t, size_t)>& task) {
+            _scheduler.run(n, 1, [&](size_t begin, size_t end, int) { task(begin, end); });
+        };
+    }
+
+    // Try to evaluate the expression list in parallel. Returns false if this
+    // is not possible or not worthwhile.
+    bool eval(const mu::Parser& main_parser, const std::string& expr, Arena& arena, double* first_result)
+    {
+        if (expr.length() < min_length)
+            return false;
+        ExprInfo info = analyze_expr(expr);
+        if (info.has_assignment || info.uses_impure_functions)
+            return false;
+        split(expr, _parts);
+        if (_parts.size() < 2)
+            return false;
+        const mu::varmap_type& vars = main_parser.GetVar();
+        for (size_t t = 0; t < _evaluators.size(); t++) {
+            mu::Parser& parser = _evaluators[t]->parser;
+            parser.ClearVar();
+            _evaluators[t]->vars.clear();
+            for (mu::varmap_type::const_iterator it = vars.begin(); it != vars.end(); it++)
+                parser.DefineVar(it->first, it->second);
+        }
+        _results.resize(_parts.size());
+        _ok.resize(_parts.size());
+        const std::atomic<bool>* cancel = eval_cancel_flag;
+        _scheduler.run(_parts.size(), 1, [&](size_t begin, size_t end, int thread_index) {
+            mu::Parser& parser = _evaluators[thread_index]->parser;
+            for (size_t i = begin; i < end; i++) {
+                if (cancel && cancel->load(std::memory_order_relaxed)) {
+                    _ok[i] = false;
+                    continue;
+                }
+                try {
+                    parser.SetExpr(_parts[i]);
+                    int n;
+                    double* results = parser.Eval(n);
+                    _results[i] = results[0];
+                    _ok[i] = (n == 1);
+                }
+                catch (mu::Parser::exception_type&) {
+                    _ok[i] = false;
+                }
+            }
+        });
+        for (size_t t = 0; t < _evaluators.size(); t++) {
+            // Names unknown to the main parser must be created there
+            if (!_evaluators[t]->vars.empty())
+                return false;
+        }
+        for (size_t i = 0; i < _parts.size(); i++)
+            if (!_ok[i])
+                return false;
+        format_results(_results.data(), _results.size(), arena);
+        *first_result = _results[0];
+        return true;
+    }
+};
+
+// The thread count is set in main(); the evaluator and its threads are only
+// created when the first long line is evaluated
+static int list_threads = 1;
+static bool list_pin_threads = false;
+static std::unique_ptr<ListEvaluator> list_evaluator;
+
+static ListEvaluator* get_list_evaluator(const std::string& expr)
+{
+    if (!list_evaluator && list_threads > 1 && expr.length() >= ListEvaluator::min_length)
+        list_evaluator.reset(new ListEvaluator(list_threads, list_pin_threads));
+    return list_evaluator.get();
+}
+
+static ParallelFor list_parallel_for(ListEvaluator* list_evaluator)
+{
+    return (list_evaluator ? list_evaluator->parallel_for() : ParallelFor());
+}
+
+static bool list_eval(ListEvaluator* list_evaluator, const mu::Parser& parser,
+        const std::string& expr, Arena& arena, double* first_result)
+{
+    return (list_evaluator && list_evaluator->eval(parser, expr, arena, first_result));
+}
+
+// Evaluate an expression with the main parser, using parallel evaluation of
+// expression lists where possible
+static int eval_main(mu::Parser& parser,
+        double* last_result,
+        const std::string& expr,
+        const ErrorContext& context,
+        Arena& arena)
+{
+    return eval(parser, last_result, expr, context, arena, get_list_evaluator(expr));
+}
+
+static int eval_and_print(mu::Parser& parser,
+        double* last_result,
+        const std::string& expr,
+        const ErrorContext& context = ErrorContext())
+{
+    static Arena arena;
+    arena.reset();
+    int retval = eval_main(parser, last_result, expr, context, arena);
+    fwrite(arena.data(), 1, arena.size(), retval == 0 ? stdout : stderr);
+    return retval;
+}
+
+/* sharded output files */
+
+// With --output-shards, evaluation threads write the results of the chunks
+// they process directly to shard files instead of handing them back to the
+// main thread for ordered output. Thread t writes to shard t % N. A manifest
+// file lists, for each part of each shard, the range of input lines it holds,
+// the number of output lines and its byte range, so that the input order can
+// be reconstructed. Input lines with errors have no output lines.
+class ShardWriter
+{
+private:
+    struct Entry
+    {
+        size_t first_line, last_line; // input line numbers
+        size_t output_lines;          // number of lines in the shard
+        int shard;
+        size_t offset, length;        // byte range in the shard file
+    };
+
+    struct Shard
+    {
+        std::mutex mutex;
+        FILE* file;
+        size_t size;
+        std::vector<Entry> entries;
+    };
+
+    std::string _pattern;
+    std::vector<std::unique_ptr<Shard>> _shards;
+
+public:
+    static std::string file_name(const std::string& pattern, const std::string& replacement)
+    {
+        std::string name = pattern;
+        size_t pos = name.find("%d");
+        if (pos != std::string::npos)
+            name.replace(pos, 2, replacement);
+        return name;
+    }
+
+    ShardWriter()
+    {
+    }
+
+    ~ShardWriter()
+    {
+        for (size_t i = 0; i < _shards.size(); i++)
+            if (_shards[i]->file)
+                fclose(_shards[i]->file);
+    }
+
+    bool enabled() const
+    {
+        return _shards.size() > 0;
+    }
+
+    bool open(int count, const std::string& pattern)
+    {
+        _pattern = pattern;
+        for (int i = 0; i < count; i++) {
+            std::string name = file_name(pattern, std::to_string(i));
+            _shards.emplace_back(new Shard);
+            _shards.back()->size = 0;
+            _shards.back()->file = fopen(name.c_str(), "wb");
+            if (!_shards.back()->file) {
+                fprintf(stderr, "%s: %s\n", name.c_str(), strerror(errno));
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Write the results of the lines [begin, end), which were evaluated by
+    // the given thread into the given arena.
+    void write(int thread_index, const Line* begin, const Line* end, const Arena& arena)
+    {
+        if (begin == end)
+            return;
+        int shard_index = thread_index % _shards.size();
+        Shard& shard = *_shards[shard_index];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        Entry entry = { begin->number, (end - 1)->number, 0, shard_index, shard.size, 0 };
+        for (const Line* line = begin; line != end; line++) {
+            if (line->status == 0) {
+                const char* output = arena.data(line->output.offset);
+                fwrite(output, 1, line->output.length, shard.file);
+                entry.output_lines += std::count(output, output + line->output.length, '\n');
+                entry.length += line->output.length;
+            }
+        }
+        shard.size += entry.length;
+        shard.entries.push_back(entry);
+    }
+
+    // Close the shard files and write the manifest. Its name is the pattern
+    // with %d replaced by "index". Each line of the manifest has the form
+    // <first line> <last line> <output lines> <shard> <byte offset> <byte length>.
+    bool close()
+    {
+        bool ok = true;
+        std::vector<Entry> entries;
+        for (size_t i = 0; i < _shards.size(); i++) {
+            entries.insert(entries.end(), _shards[i]->entries.begin(), _shards[i]->entries.end());
+            if (fclose(_shards[i]->file) != 0) {
+                fprintf(stderr, "%s: %s\n", file_name(_pattern, std::to_string(i)).c_str(), strerror(errno));
+                ok = false;
+            }
+            _shards[i]->file = NULL;
+        }
+        std::sort(entries.begin(), entries.end(),
+                [](const Entry& a, const Entry& b) { return a.first_line < b.first_line; });
+        std::string name = file_name(_pattern, "index");
+        FILE* f = fopen(name.c_str(), "w");
+        if (!f) {
+            fprintf(stderr, "%s: %s\n", name.c_str(), strerror(errno));
+            return false;
+        }
+        for (size_t i = 0; i < entries.size(); i++) {
+            fprintf(f, "%zu %zu %zu %d %zu %zu\n", entries[i].first_line, entries[i].last_line,
+                    entries[i].output_lines, entries[i].shard, entries[i].offset, entries[i].length);
+        }
+        if (fclose(f) != 0) {
+            fprintf(stderr, "%s: %s\n", name.c_str(), strerror(errno));
+            ok = false;
+        }
+        return ok;
+    }
+};
+
+/* fused evaluation of several column mode expressions */
+
+// The column mode expressions are joined into one expression list, so that
+// muparser compiles them once and evaluates them in one pass per row, with
+// one output row per input row. Subexpressions that occur more than once are
+// assigned to hidden variables at the start of the list and then used by
+// name, so they are computed once per row; their results are not printed.
+struct ColumnExpr
+{
+    std::string text;   // the expressions as given, for error messages
+    std::string fused;  // with common subexpressions hoisted
+    int hidden;         // number of hoisted subexpressions
+
+    ColumnExpr() : hidden(0)
+    {
+    }
+};
+
+// A parenthesized group, the argument of a function call, or a function call
+// in one of the expressions
+struct ExprGroup
+{
+    size_t expr;        // index of the expression
+    size_t begin, end;  // the text that is replaced by the hidden variable
+    std::string key;    // the subexpression without blanks
+};
+
+static const char cse_prefix[] = "_cse";
+
+static void add_group(const std::string& expr, size_t index, size_t begin, size_t end,
+        bool parenthesize, std::vector<ExprGroup>& groups)
+{
+    ExprGroup group;
+    group.expr = index;
+    group.begin = begin;
+    group.end = end;
+    if (parenthesize)
+        group.key.push_back('(');
+    for (size_t j = begin; j < end; j++)
+        if (expr[j] != ' ' && expr[j] != '\t')
+            group.key.push_back(expr[j]);
+    if (parenthesize)
+        group.key.push_back(')');
+    // Skip groups that only hold a name or number, and groups with side
+    // effects or random numbers
+    if (group.key[0] == '(' && group.key.find_first_not_of(
+                "()._0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ") == std::string::npos)
+        return;
+    ExprInfo info = analyze_expr(group.key);
+    if (!info.has_assignment && !info.uses_impure_functions)
+        groups.push_back(group);
+}
+
+// Find the groups in expr. If whole is set, expr is a complete expression,
+// which is a group too unless it is a list.
+static void find_groups(const std::string& expr, size_t index, bool whole, std::vector<ExprGroup>& groups)
+{
+    struct Open
+    {
+        size_t name_begin, paren;
+        bool has_comma;
+    };
+    std::vector<Open> open;
+    bool in_string = false;
+    bool has_comma = false;
+    for (size_t i = 0; i < expr.size(); i++) {
+        char c = expr[i];
+        if (c == '"') {
+            in_string = !in_string;
+        } else if (in_string) {
+            continue;
+        } else if (c == '(') {
+            size_t begin = i;
+            while (begin > 0 && (isalnum(static_cast<unsigned char>(expr[begin - 1])) || expr[begin - 1] == '_'))
+                begin--;
+            Open o = { begin, i, false };
+            open.push_back(o);
+        } else if (c == ',') {
+            if (open.empty())
+                has_comma = true;
+            else
+                open.back().has_comma = true;
+        } else if (c == ')' && !open.empty()) {
+            Open o = open.back();
+            open.pop_back();
+            if (o.name_begin < o.paren) {
+                // the call, and its single argument without the parentheses
+                add_group(expr, index, o.name_begin, i + 1, false, groups);
+                if (!o.has_comma)
+                    add_group(expr, index, o.paren + 1, i, true, groups);
+            } else if (!o.has_comma) {
+                add_group(expr, index, o.paren, i + 1, false, groups);
+            }
+        }
+    }
+    if (whole && !has_comma && open.empty())
+        add_group(expr, index, 0, expr.size(), true, groups);
+}
+
+static ColumnExpr fuse_column_exprs(const std::vector<std::string>& exprs)
+{
+    ColumnExpr result;
+    for (size_t i = 0; i < exprs.size(); i++) {
+        if (i > 0)
+            result.text += ", ";
+        result.text += exprs[i];
+    }
+    result.fused = result.text;
+    // Assignments could change a subexpression between its uses
+    if (result.text.find(cse_prefix) != std::string::npos || analyze_expr(result.text).has_assignment)
+        return result;
+
+    // Repeatedly hoist the longest subexpression that occurs more than once.
+    // The texts of the definitions are searched too, so shorter common parts
+    // of hoisted subexpressions are found in later rounds.
+    std::vector<std::string> texts(exprs);
+    size_t first_def = texts.size();
+    std::vector<ExprGroup> groups;
+    const int max_hidden = 256;
+    while (static_cast<int>(texts.size() - first_def) < max_hidden) {
+        groups.clear();
+        for (size_t i = 0; i < texts.size(); i++)
+            find_groups(texts[i], i, i < first_def, groups);
+        std::map<std::string, int> counts;
+        for (size_t i = 0; i < groups.size(); i++)
+            counts[groups[i].key]++;
+        const ExprGroup* best = NULL;
+        for (size_t i = 0; i < groups.size(); i++) {
+            if (counts[groups[i].key] > 1 && (!best || groups[i].key.size() > best->key.size()))
+                best = &groups[i];
+        }
+        if (!best)
+            break;
+        std::string key = best->key;
+        std::string name = cse_prefix + std::to_string(texts.size() - first_def + 1);
+        std::string definition = name + "=" + best->key;
+        // Equal groups cannot overlap, so replace them back to front
+        for (size_t i = groups.size(); i > 0; i--) {
+            const ExprGroup& group = groups[i - 1];
+            if (group.key == key)
+                texts[group.expr].replace(group.begin, group.end - group.begin, name);
+        }
+        texts.push_back(definition);
+    }
+    result.hidden = texts.size() - first_def;
+    if (result.hidden == 0)
+        return result;
+
+    // A hoisted subexpression can only contain those found after it, since
+    // longer ones are found first, so the definitions are listed in reverse
+    result.fused.clear();
+    for (size_t i = texts.size(); i > first_def; i--)
+        result.fused += texts[i - 1] + ", ";
+    for (size_t i = 0; i < first_def; i++)
+        result.fused += texts[i] + (i + 1 < first_def ? ", " : "");
+    return result;
+}
+
+// Evaluate standard input in batches of lines using the scheduler. In column
+// mode, each line is a row of values for the column variables and the
+// expression is evaluated for each row; if the expressions assign variables
+// or use _, the rows depend on each other and are evaluated in order on the
+// main thread. Otherwise, each line is an expression; runs of independent
+// lines are evaluated in parallel and all other lines are evaluated in order
+// by the main parser. Results are printed in input order.
+static int eval_stdin_parallel(mu::Parser& parser, double* last_result,
+        const Options& options, const ColumnExpr& column_expr)
+{
+    int retval = 0;
+    bool column_mode = !options.columns.empty();
+    ShardWriter shard_writer;
+    if (options.output_shards > 0 && !shard_writer.open(options.output_shards, options.output_pattern))
+        return 1;
+    bool print_results = !shard_writer.enabled();
+    Scheduler scheduler(options.max_threads, options.pin_threads);
+    BatchTuner tuner(options);
+    auto new_evaluator = [&]() {
+        Evaluator* evaluator = new Evaluator;
+        if (column_mode) {
+            evaluator->columns.resize(options.columns.size(), 0.0);
+            for (size_t c = 0; c < options.columns.size(); c++)
+                evaluator->parser.DefineVar(options.columns[c], &(evaluator->columns[c]));
+        }
+        return evaluator;
+    };
+    std::vector<std::unique_ptr<Evaluator>> evaluators;
+    for (int t = 0; t < scheduler.thread_count(); t++)
+        evaluators.emplace_back(new_evaluator());
+    bool rows_independent = true;
+    if (column_mode) {
+        // Report errors in the expressions once instead of for each row
+        try {
+            evaluators[0]->parser.SetExpr(column_expr.text);
+            evaluators[0]->parser.Eval();
+        }
+        catch (mu::Parser::exception_type& e) {
+            Arena& arena = evaluators[0]->arena;
+            format_error(e, ErrorContext("Expression"), arena);
+            fwrite(arena.data(), 1, arena.size(), stderr);
+            return 1;
+        }
+        // Use the fused expression list unless it unexpectedly fails. The
+        // precision check needs the expressions without the assignments to
+        // hidden variables, and evaluating them again must not have side
+        // effects.
+        ExprInfo info = analyze_expr(column_expr.text);
+        bool check = check_precision && !info.has_assignment && !info.uses_impure_functions;
+        // Variables that are assigned, and _, carry state from row to row,
+        // so such rows are evaluated in order by the evaluator of the main
+        // thread. It is replaced by a fresh one, since the checks above have
+        // already evaluated the assignments once.
+        rows_independent = !info.has_assignment && !info.uses_last_result;
+        if (!rows_independent)
+            evaluators[0].reset(new_evaluator());
+        const std::string* expr = &column_expr.text;
+        int hidden = 0;
+        if (!check) {
+            try {
+                evaluators[0]->parser.SetExpr(column_expr.fused);
+                evaluators[0]->parser.Eval();
+                expr = &column_expr.fused;
+                hidden = column_expr.hidden;
+            }
+            catch (mu::Parser::exception_type&) {
+            }
+        }
+        for (size_t t = 0; t < evaluators.size(); t++) {
+            evaluators[t]->parser.SetExpr(*expr);
+            evaluators[t]->hidden_results = hidden;
+            evaluators[t]->check_precision = check;
+        }
+        if (profile.enabled && hidden > 0)
+            fprintf(stderr, "Profile: %d common subexpressions: %s\n", hidden, expr->c_str());
+        if (profile.enabled && !rows_independent)
+            fprintf(stderr, "Profile: rows depend on each other and are evaluated in order\n");
+    }
+
+    std::vector<Line> lines;
+    size_t linecounter = 1;
+    while (std::cin) {
+        std::chrono::steady_clock::time_point batch_start = std::chrono::steady_clock::now();
+        size_t batch_size = tuner.batch_size();
+        int threads = tuner.threads();
+        // Use a few chunks per thread so that work stealing can balance the load
+        size_t chunk_size = std::max(batch_size / (threads * 8), static_cast<size_t>(1));
+        if (lines.size() < batch_size)
+            lines.resize(batch_size);
+        // Read a batch of lines
+        size_t n = 0;
+        while (n < batch_size && std::getline(std::cin, lines[n].text)) {
+            if (!lines[n].text.empty()) {
+                Line& line = lines[n];
+                line.number = linecounter;
+                line.independent = (column_mode ? rows_independent : is_independent(line.text));
+                line.status = 0;
+                n++;
+            }
+            linecounter++;
+        }
+        // Evaluate the batch
+        for (size_t t = 0; t < evaluators.size(); t++)
+            evaluators[t]->arena.reset();
+        Scheduler::Task task = [&](size_t begin, size_t end, int thread_index) {
+            Evaluator& evaluator = *evaluators[thread_index];
+            for (size_t i = begin; i < end; i++) {
+                if (column_mode)
+                    eval_row(evaluator, lines[i], thread_index);
+                else
+                    eval_line(evaluator.parser, evaluator.arena, thread_index, lines[i]);
+            }
+            if (shard_writer.enabled())
+                shard_writer.write(thread_index, &lines[begin], &lines[end - 1] + 1, evaluator.arena);
+        };
+        size_t i = 0;
+        while (i < n) {
+            if (lines[i].independent) {
+                size_t run_end = i + 1;
+                while (run_end < n && lines[run_end].independent)
+                    run_end++;
+                scheduler.run(run_end - i, chunk_size,
+                        [&](size_t begin, size_t end, int thread_index) {
+                            task(i + begin, i + end, thread_index);
+                        }, threads);
+                for (; i < run_end; i++)
+                    print_line(lines[i], evaluators, print_results, last_result, &retval);
+            } else {
+                // the main thread is thread 0, so it can use that arena
+                if (column_mode)
+                    eval_row(*evaluators[0], lines[i], 0);
+                else
+                    eval_line(parser, evaluators[0]->arena, 0, lines[i]);
+                if (shard_writer.enabled())
+                    shard_writer.write(0, &lines[i], &lines[i] + 1, evaluators[0]->arena);
+                print_line(lines[i], evaluators, print_results, last_result, &retval);
+                i++;
+            }
+        }
+        if (n > 0) {
+            bool was_tuning = tuner.tuning();
+            tuner.report(n, Profile::seconds_since(batch_start));
+            if (profile.enabled && was_tuning && !tuner.tuning()) {
+                fprintf(stderr, "Profile: tuned batch size %zu, %d threads\n",
+                        tuner.batch_size(), tuner.threads());
+            }
+            profile.lines += n;
+            profile.batches++;
+            size_t arena_bytes = 0;
+            for (size_t t = 0; t < evaluators.size(); t++)
+                arena_bytes += evaluators[t]->arena.size();
+            profile.arena_bytes = std::max(profile.arena_bytes, arena_bytes);
+        }
+    }
+    if (shard_writer.enabled() && !shard_writer.close())
+        retval = 1;
+    return retval;
+}
+
+/* grid evaluation with raster output */
+
+// Parse "x=a:b:nx,y=c:d:ny"
+static bool parse_grid(const char* arg, std::vector<GridAxis>& axes)
+{
+    axes.clear();
+    const char* p = arg;
+    for (int a = 0; a < 2; a++) {
+        GridAxis axis;
+        const char* name_end = strchr(p, '=');
+        if (!name_end || name_end == p)
+            return false;
+        axis.name.assign(p, name_end);
+        for (size_t i = 0; i < axis.name.size(); i++)
+            if (!(isalpha(static_cast<unsigned char>(axis.name[i])) || axis.name[i] == '_'
+                        || (i > 0 && isdigit(static_cast<unsigned char>(axis.name[i])))))
+                return false;
+        char* end;
+        axis.first = strtod(name_end + 1, &end);
+        if (end == name_end + 1 || *end != ':')
+            return false;
+        p = end + 1;
+        axis.last = strtod(p, &end);
+        if (end == p || *end != ':')
+            return false;
+        p = end + 1;
+        errno = 0;
+        long n = strtol(p, &end, 10);
+        if (end == p || errno != 0 || n < 1 || n > (1 << 20))
+            return false;
+        axis.n = n;
+        axes.push_back(axis);
+        if (a == 0) {
+            if (*end != ',')
+                return false;
+            p = end + 1;
+        } else if (*end != '\0') {
+            return false;
+        }
+    }
+    return (axes[0].name != axes[1].name);
+}
+
+// The evaluation state of one thread in grid mode. The variables are bound
+// to arrays, so that muparser evaluates a whole tile in one bulk call.
+struct GridEvaluator
+{
+    mu::Parser parser;
+    VarList vars;
+    double last_result;
+    std::vector<double> x, y, results;
+
+    GridEvaluator(const std::vector<GridAxis>& axes, size_t tile_size) :
+        last_result(0.0), x(tile_size), y(tile_size), results(tile_size)
+    {
+        init_parser(parser, &vars, &last_result);
+        // Only the grid variables are valid in bulk mode
+        parser.ClearVar();
+        parser.SetVarFactory(NULL, NULL);
+        parser.DefineVar(axes[0].name, x.data());
+        parser.DefineVar(axes[1].name, y.data());
+    }
+};
+
+// Write the nx*ny raster in the format given by the file name extension:
+// .pfm (float), .pgm (16 bit, values from [0,1]), or raw floats otherwise.
+// The first row holds the first y value in all formats.
+static bool write_raster(const std::string& file_name, const float* image, size_t nx, size_t ny)
+{
+    std::string ext = (file_name.size() >= 4 ? file_name.substr(file_name.size() - 4) : std::string());
+    for (size_t i = 0; i < ext.size(); i++)
+        ext[i] = tolower(static_cast<unsigned char>(ext[i]));
+    FILE* f = (file_name.empty() ? stdout : fopen(file_name.c_str(), "wb"));
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", file_name.c_str(), strerror(errno));
+        return false;
+    }
+    bool ok = true;
+    if (ext == ".pfm") {
+        // PFM stores the bottom row first; a negative scale means little endian
+        const uint16_t one = 1;
+        bool little_endian = (*reinterpret_cast<const unsigned char*>(&one) == 1);
+        fprintf(f, "Pf\n%zu %zu\n%s\n", nx, ny, little_endian ? "-1.0" : "1.0");
+        for (size_t row = ny; row > 0 && ok; row--)
+            ok = (fwrite(image + (row - 1) * nx, sizeof(float), nx, f) == nx);
+    } else if (ext == ".pgm") {
+        fprintf(f, "P5\n%zu %zu\n65535\n", nx, ny);
+        std::vector<unsigned char> row(2 * nx);
+        for (size_t r = 0; r < ny && ok; r++) {
+            for (size_t i = 0; i < nx; i++) {
+                float v = image[r * nx + i];
+                unsigned int u = (v >= 1.0f ? 65535 : v > 0.0f ? static_cast<unsigned int>(v * 65535.0f + 0.5f) : 0);
+                row[2 * i] = u >> 8;
+                row[2 * i + 1] = u & 0xff;
+            }
+            ok = (fwrite(row.data(), 1, row.size(), f) == row.size());
+        }
+    } else {
+        ok = (fwrite(image, sizeof(float), nx * ny, f) == nx * ny);
+    }
+    if (f == stdout)
+        ok = (fflush(f) == 0) && ok;
+    else
+        ok = (fclose(f) == 0) && ok;
+    if (!ok)
+        fprintf(stderr, "%s: %s\n", file_name.empty() ? "Standard output" : file_name.c_str(), strerror(errno));
+    return ok;
+}
+
+// Evaluate the expression for each point of the grid, tile by tile on all
+// threads, and write the results as a raster
+static int eval_grid(const Options& options, const std::string& expr)
+{
+    if (options.output_file.empty() && isatty(fileno(stdout))) {
+        fprintf(stderr, "Grid mode writes a raster; use --output FILE or redirect standard output\n");
+        return 1;
+    }
+    const GridAxis& ax = options.grid[0];
+    const GridAxis& ay = options.grid[1];
+    // Tiles of 64x64 points keep the variable and result arrays in the L1/L2 cache
+    const size_t tile_width = 64, tile_height = 64;
+    Scheduler scheduler(options.bulk_threads(), options.pin_threads);
+    std::vector<std::unique_ptr<GridEvaluator>> evaluators;
+    for (int t = 0; t < scheduler.thread_count(); t++) {
+        evaluators.emplace_back(new GridEvaluator(options.grid, tile_width * tile_height));
+        evaluators.back()->parser.SetExpr(expr);
+    }
+    try {
+        evaluators[0]->parser.Eval();
+    }
+    catch (mu::Parser::exception_type& e) {
+        Arena arena;
+        format_error(e, ErrorContext("Expression"), arena);
+        fwrite(arena.data(), 1, arena.size(), stderr);
+        return 1;
+    }
+
+    std::vector<float, LargeAllocator<float>> image(ax.n * ay.n);
+    size_t tiles_x = (ax.n + tile_width - 1) / tile_width;
+    size_t tiles_y = (ay.n + tile_height - 1) / tile_height;
+    std::atomic<bool> failed(false);
+    scheduler.run(tiles_x * tiles_y, 1, [&](size_t begin, size_t end, int thread_index) {
+        GridEvaluator& evaluator = *evaluators[thread_index];
+        for (size_t tile = begin; tile < end; tile++) {
+            size_t x0 = (tile % tiles_x) * tile_width;
+            size_t y0 = (tile / tiles_x) * tile_height;
+            size_t w = std::min(tile_width, ax.n - x0);
+            size_t h = std::min(tile_height, ay.n - y0);
+            for (size_t j = 0; j < h; j++) {
+                for (size_t i = 0; i < w; i++) {
+                    evaluator.x[j * w + i] = ax.at(x0 + i);
+                    evaluator.y[j * w + i] = ay.at(y0 + j);
+                }
+            }
+            try {
+                evaluator.parser.Eval(evaluator.results.data(), w * h);
+            }
+            catch (mu::Parser::exception_type&) {
+                failed = true;
+                std::fill(evaluator.results.begin(), evaluator.results.end(), NAN);
+            }
+            for (size_t j = 0; j < h; j++)
+                for (size_t i = 0; i < w; i++)
+                    image[(y0 + j) * ax.n + x0 + i] = evaluator.results[j * w + i];
+        }
+    });
+    profile.lines += ax.n * ay.n;
+    if (failed)
+        fprintf(stderr, "Evaluation failed for parts of the grid\n");
+    if (!write_raster(options.output_file, image.data(), ax.n, ay.n))
+        return 1;
+    return (failed ? 1 : 0);
+}
+
+/* NumPy .npy input and output */
+
+// A one-dimensional array from an .npy file. Arrays of little-endian doubles
+// are used in place; other number types are converted to doubles once.
+struct NpyArray
+{
+    MappedFile file;
+    size_t length;
+    const double* values;
+    std::vector<double, LargeAllocator<double>> converted;
+};
+
+static bool host_is_little_endian()
+{
+    const uint16_t one = 1;
+    return (*reinterpret_cast<const unsigned char*>(&one) == 1);
+}
+
+// Find the value of a key in the header dictionary, e.g. "'shape': (10,)"
+static const char* npy_header_value(const std::string& header, const char* key)
+{
+    size_t pos = header.find(key);
+    if (pos == std::string::npos)
+        return NULL;
+    pos = header.find(':', pos + strlen(key));
+    if (pos == std::string::npos)
+        return NULL;
+    pos++;
+    while (pos < header.size() && header[pos] == ' ')
+        pos++;
+    return header.c_str() + pos;
+}
+
+template<typename T> static void npy_convert(const char* data, size_t length, double* values)
+{
+    for (size_t i = 0; i < length; i++) {
+        T v;
+        memcpy(&v, data + i * sizeof(T), sizeof(T));
+        values[i] = v;
+    }
+}
+
+static bool npy_open(const std::string& name, NpyArray& array)
+{
+    if (!array.file.open(name))
+        return false;
+    const char* data = array.file.data();
+    size_t size = array.file.size();
+    if (size < 10 || memcmp(data, "\x93NUMPY", 6) != 0 || data[6] < 1 || data[6] > 3) {
+        fprintf(stderr, "%s: not an .npy file\n", name.c_str());
+        return false;
+    }
+    size_t header_start = (data[6] == 1 ? 10 : 12);
+    size_t header_length = static_cast<unsigned char>(data[8])
+        | static_cast<unsigned char>(data[9]) << 8;
+    if (data[6] > 1 && size >= 12) {
+        header_length |= static_cast<size_t>(static_cast<unsigned char>(data[10])) << 16
+            | static_cast<size_t>(static_cast<unsigned char>(data[11])) << 24;
+    }
+    if (header_start + header_length > size) {
+        fprintf(stderr, "%s: truncated .npy header\n", name.c_str());
+        return false;
+    }
+    std::string header(data + header_start, header_length);
+    const char* descr = npy_header_value(header, "'descr'");
+    const char* fortran_order = npy_header_value(header, "'fortran_order'");
+    const char* shape = npy_header_value(header, "'shape'");
+    // The shape must be (n,) or (n, 1) or (1, n)
+    std::vector<size_t> dims;
+    if (shape && *shape == '(') {
+        const char* p = shape + 1;
+        for (;;) {
+            while (*p == ' ' || *p == ',')
+                p++;
+            if (!isdigit(static_cast<unsigned char>(*p)))
+                break;
+            char* end;
+            dims.push_back(strtoull(p, &end, 10));
+            p = end;
+        }
+    }
+    int non_trivial_dims = 0;
+    for (size_t i = 0; i < dims.size(); i++)
+        non_trivial_dims += (dims[i] != 1);
+    if (!descr || (*descr != '\'' && *descr != '"') || !fortran_order || dims.empty() || non_trivial_dims > 1) {
+        fprintf(stderr, "%s: unsupported .npy header %s\n", name.c_str(), header.c_str());
+        return false;
+    }
+    // The type is a byte order character, a kind, and the item size
+    char byte_order = descr[1];
+    char kind = descr[2];
+    int item_size = atoi(descr + 3);
+    // The size in bytes of a crafted shape must not wrap around
+    size_t length = 1;
+    size_t max_length = SIZE_MAX / std::max(item_size, 1);
+    for (size_t i = 0; i < dims.size(); i++) {
+        if (dims[i] != 0 && length > max_length / dims[i]) {
+            fprintf(stderr, "%s: .npy shape too large\n", name.c_str());
+            return false;
+        }
+        length *= dims[i];
+    }
+    bool native = (byte_order == '|' || byte_order == '='
+            || (byte_order == '<' && host_is_little_endian())
+            || (byte_order == '>' && !host_is_little_endian()));
+    const char* values = data + header_start + header_length;
+    if ((!native && item_size > 1) || !strchr("fiub", kind)
+            || length > (size - header_start - header_length) / std::max(item_size, 1)) {
+        fprintf(stderr, "%s: unsupported .npy data type or truncated data\n", name.c_str());
+        return false;
+    }
+    array.length = length;
+    if (kind == 'f' && item_size == 8 && reinterpret_cast<uintptr_t>(values) % alignof(double) == 0) {
+        array.values = reinterpret_cast<const double*>(values);
+        return true;
+    }
+    array.converted.resize(length);
+    double* converted = array.converted.data();
+    if (kind == 'f' && item_size == 8)
+        npy_convert<double>(values, length, converted);
+    else if (kind == 'f' && item_size == 4)
+        npy_convert<float>(values, length, converted);
+    else if (kind == 'i' && item_size == 1)
+        npy_convert<int8_t>(values, length, converted);
+    else if (kind == 'i' && item_size == 2)
+        npy_convert<int16_t>(values, length, converted);
+    else if (kind == 'i' && item_size == 4)
+        npy_convert<int32_t>(values, length, converted);
+    else if (kind == 'i' && item_size == 8)
+        npy_convert<int64_t>(values, length, converted);
+    else if ((kind == 'u' || kind == 'b') && item_size == 1)
+        npy_convert<uint8_t>(values, length, converted);
+    else if (kind == 'u' && item_size == 2)
+        npy_convert<uint16_t>(values, length, converted);
+    else if (kind == 'u' && item_size == 4)
+        npy_convert<uint32_t>(values, length, converted);
+    else if (kind == 'u' && item_size == 8)
+        npy_convert<uint64_t>(values, length, converted);
+    else {
+        fprintf(stderr, "%s: unsupported .npy data type %c%d\n", name.c_str(), kind, item_size);
+        return false;
+    }
+    array.values = converted;
+    return true;
+}
+
+// Create an .npy file for k columns of n doubles. The columns are stored one
+// after the other (Fortran order), so that each can be written in one pass.
+static double* npy_create(MappedFile& file, const std::string& name, size_t n, size_t k)
+{
+    char dict[128];
+    if (k == 1) {
+        snprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': False, 'shape': (%zu,), }",
+                host_is_little_endian() ? "<f8" : ">f8", n);
+    } else {
+        snprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': True, 'shape': (%zu, %zu), }",
+                host_is_little_endian() ? "<f8" : ">f8", n, k);
+    }
+    // Pad the header with blanks and a newline to a multiple of 64 bytes
+    std::string header(dict);
+    size_t header_size = (10 + header.size() + 1 + 63) / 64 * 64;
+    header.append(header_size - 10 - header.size() - 1, ' ');
+    header.push_back('\n');
+    if (!file.create(name, header_size + n * k * sizeof(double)))
+        return NULL;
+    char* data = file.data();
+    memcpy(data, "\x93NUMPY\x01\x00", 8);
+    data[8] = header.size() & 0xff;
+    data[9] = header.size() >> 8;
+    memcpy(data + 10, header.data(), header.size());
+    return reinterpret_cast<double*>(data + header_size);
+}
+
+// Evaluate the expressions for all rows of the .npy columns. The variables
+// are bound to the mapped columns and each expression is evaluated in
+// muparser's bulk mode, on one contiguous part of the rows per thread, with
+// the results written directly to the mapped output file. Without an output
+// file, the results are printed one row per line.
+static int eval_npy(const Options& options, const std::vector<std::string>& exprs)
+{
+    std::vector<std::unique_ptr<NpyArray>> arrays;
+    size_t n = 0;
+    for (size_t c = 0; c < options.npy_columns.size(); c++) {
+        arrays.emplace_back(new NpyArray);
+        if (!npy_open(options.npy_columns[c].second, *arrays.back()))
+            return 1;
+        if (c > 0 && arrays.back()->length != n) {
+            fprintf(stderr, "%s: %zu values instead of %zu\n", options.npy_columns[c].second.c_str(),
+                    arrays.back()->length, n);
+            return 1;
+        }
+        n = arrays.back()->length;
+    }
+    size_t k = exprs.size();
+
+    Scheduler scheduler(options.bulk_threads(), options.pin_threads);
+    std::vector<std::unique_ptr<Evaluator>> evaluators;
+    for (int t = 0; t < scheduler.thread_count(); t++) {
+        evaluators.emplace_back(new Evaluator);
+        // Only the column variables are valid in bulk mode
+        evaluators.back()->parser.ClearVar();
+        evaluators.back()->parser.SetVarFactory(NULL, NULL);
+    }
+    // Report errors in the expressions once, with the columns bound to zeros
+    mu::Parser& check_parser = evaluators[0]->parser;
+    std::vector<double> zeros(options.npy_columns.size(), 0.0);
+    for (size_t c = 0; c < options.npy_columns.size(); c++)
+        check_parser.DefineVar(options.npy_columns[c].first, &zeros[c]);
+    for (size_t e = 0; e < k; e++) {
+        try {
+            check_parser.SetExpr(exprs[e]);
+            check_parser.Eval();
+        }
+        catch (mu::Parser::exception_type& err) {
+            Arena& arena = evaluators[0]->arena;
+            format_error(err, ErrorContext("Expression", e + 1), arena);
+            fwrite(arena.data(), 1, arena.size(), stderr);
+            return 1;
+        }
+    }
+
+    MappedFile output;
+    std::vector<double, LargeAllocator<double>> printed_results;
+    double* results;
+    if (!options.output_file.empty()) {
+        results = npy_create(output, options.output_file, n, k);
+        if (!results)
+            return 1;
+    } else {
+        printed_results.resize(n * k);
+        results = printed_results.data();
+    }
+
+    // One part per thread; bulk mode takes an int row count
+    size_t part_size = std::min((n + scheduler.thread_count() - 1) / scheduler.thread_count(),
+            static_cast<size_t>(1) << 30);
+    size_t parts = (part_size > 0 ? (n + part_size - 1) / part_size : 0);
+    std::atomic<bool> failed(false);
+    scheduler.run(parts, 1, [&](size_t begin, size_t end, int thread_index) {
+        mu::Parser& parser = evaluators[thread_index]->parser;
+        for (size_t part = begin; part < end; part++) {
+            size_t first = part * part_size;
+            size_t count = std::min(part_size, n - first);
+            for (size_t c = 0; c < arrays.size(); c++)
+                parser.DefineVar(options.npy_columns[c].first, const_cast<double*>(arrays[c]->values + first));
+            for (size_t e = 0; e < k; e++) {
+                try {
+                    parser.SetExpr(exprs[e]);
+                    parser.Eval(results + e * n + first, static_cast<int>(count));
+                }
+                catch (mu::Parser::exception_type&) {
+                    failed = true;
+                    std::fill(results + e * n + first, results + e * n + first + count, NAN);
+                }
+            }
+        }
+    });
+    profile.lines += n;
+    if (failed)
+        fprintf(stderr, "Evaluation failed for some rows\n");
+
+    int retval = (failed ? 1 : 0);
+    if (!options.output_file.empty()) {
+        if (!output.close())
+            retval = 1;
+    } else {
+        Arena& arena = evaluators[0]->arena;
+        arena.reset();
+        std::vector<double> row(k);
+        for (size_t i = 0; i < n; i++) {
+            for (size_t e = 0; e < k; e++)
+                row[e] = results[e * n + i];
+            format_results(row.data(), k, arena);
+            if (arena.size() >= 65536 || i == n - 1) {
+                fwrite(arena.data(), 1, arena.size(), stdout);
+                arena.reset();
+            }
+        }
+    }
+    return retval;
+}
+
+/* explain report */
+
+// --explain prints the expression tree after constant folding, as muparser's
+// optimizer folds constant parts of expressions, the operations by kind,
+// whether the expression is pure, and its estimated cost per evaluation.
+// The cost of each kind of operation is measured with a small expression in
+// muparser's bulk mode, so that the estimate reflects the actual machine and
+// muparser build.
+
+// Replace subtrees by constants if all their arguments are constant and they
+// have no side effects, using muparser to compute the values
+static void fold_constants(ExprNodePtr& n, const std::string& expr, mu::Parser& folder)
+{
+    for (size_t i = 0; i < n->args.size(); i++)
+        fold_constants(n->args[i], expr, folder);
+    if (n->kind != ExprNode::Operator && n->kind != ExprNode::Function && n->kind != ExprNode::Conditional)
+        return;
+    if (n->kind == ExprNode::Function
+            && (name_in_list(n->name.c_str(), n->name.size(), impure_function_names) || n->name == "lookup"))
+        return;
+    for (size_t i = 0; i < n->args.size(); i++)
+        if (n->args[i]->kind != ExprNode::Constant)
+            return;
+    try {
+        folder.SetExpr(expr.substr(n->begin, n->end - n->begin));
+        ExprNodePtr c(new ExprNode(ExprNode::Constant, std::string(), n->begin));
+        c->value = folder.Eval();
+        c->end = n->end;
+        c->folded = true;
+        n = std::move(c);
+    }
+    catch (mu::Parser::exception_type&) {
+    }
+}
+
+// Time per evaluation of expr in nanoseconds, measured in bulk mode with each
+// of the given variables bound to its own array of values from [0.5,1.5].
+// Returns NaN if the expression fails.
+static double explain_measure(const std::string& expr, const std::vector<std::string>& names)
+{
+    const int n = 4096;
+    static std::vector<std::vector<double>> values;
+    static std::mt19937 gen(42);
+    std::uniform_real_distribution<double> dist(0.5, 1.5);
+    while (values.size() < names.size()) {
+        values.push_back(std::vector<double>(n));
+        for (int i = 0; i < n; i++)
+            values.back()[i] = dist(gen);
+    }
+    std::vector<double> results(n);
+    VarList vars;
+    double last_result = 0.0;
+    mu::Parser parser;
+    init_parser(parser, &vars, &last_result);
+    parser.ClearVar();
+    parser.SetVarFactory(NULL, NULL);
+    for (size_t i = 0; i < names.size(); i++)
+        parser.DefineVar(names[i], values[i].data());
+    double best = NAN;
+    try {
+        parser.SetExpr(expr);
+        parser.Eval(results.data(), n); // warm up
+        for (int rep = 0; rep < 5; rep++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            int runs = 0;
+            double seconds;
+            do {
+                parser.Eval(results.data(), n);
+                runs++;
+                seconds = Profile::seconds_since(start);
+            } while (seconds < 0.002);
+            double ns = seconds * 1e9 / (static_cast<double>(runs) * n);
+            if (!(ns >= best))
+                best = ns;
+        }
+    }
+    catch (mu::Parser::exception_type&) {
+        return NAN;
+    }
+    return best;
+}
+
+// An expression that measures one kind of operation, e.g. "a+b" or
+// "sum(a,b,c)"; empty for operations that are not measured
+static std::string explain_kind(const ExprNode& n)
+{
+    static const char* arg_names[3] = { "a", "b", "c" };
+    switch (n.kind) {
+    case ExprNode::Operator:
+        if (n.args.size() == 1)
+            return n.name + "a";
+        return std::string("a") + n.name + "b";
+    case ExprNode::Conditional:
+        return "a?b:c";
+    case ExprNode::Function: {
+        if (n.name == "lookup" || n.name == "seed")
+            return std::string();
+        std::string k = n.name + "(";
+        for (size_t i = 0; i < n.args.size(); i++)
+            k += std::string(i > 0 ? "," : "") + arg_names[i % 3];
+        return k + ")";
+    }
+    default:
+        return std::string();
+    }
+}
+
+struct ExplainStats
+{
+    std::map<std::string, int> kinds;   // by measuring expression
+    std::vector<std::string> variables;
+    std::vector<std::string> impure_functions;
+    int unmeasured;                     // assignments, strings, lookups
+    int constants, folded;
+
+    ExplainStats() : unmeasured(0), constants(0), folded(0)
+    {
+    }
+};
+
+static void explain_node(const ExprNode& n, int depth, ExplainStats& stats)
+{
+    printf("  %*s", 2 * depth, "");
+    switch (n.kind) {
+    case ExprNode::Constant:
+        stats.constants++;
+        if (n.folded) {
+            stats.folded++;
+            printf("%.12g (folded)\n", n.value);
+        } else if (!n.name.empty()) {
+            printf("%s = %.12g\n", n.name.c_str(), n.value);
+        } else {
+            printf("%.12g\n", n.value);
+        }
+        break;
+    case ExprNode::Variable:
+        printf("%s (variable)\n", n.name.c_str());
+        if (std::find(stats.variables.begin(), stats.variables.end(), n.name) == stats.variables.end())
+            stats.variables.push_back(n.name);
+        break;
+    case ExprNode::String:
+        printf("\"%s\"\n", n.name.c_str());
+        break;
+    case ExprNode::Function: {
+        bool impure = name_in_list(n.name.c_str(), n.name.size(), impure_function_names);
+        printf("%s()%s\n", n.name.c_str(), impure ? " (impure)" : "");
+        if (impure && std::find(stats.impure_functions.begin(), stats.impure_functions.end(), n.name)
+                == stats.impure_functions.end())
+            stats.impure_functions.push_back(n.name);
+        break;
+    }
+    default:
+        printf("%s%s\n", n.name.c_str(), n.kind == ExprNode::Assignment ? " (assignment)" : "");
+        break;
+    }
+    std::string kind = explain_kind(n);
+    if (!kind.empty())
+        stats.kinds[kind]++;
+    else if (n.kind == ExprNode::Assignment || n.kind == ExprNode::Function)
+        stats.unmeasured++;
+    for (size_t i = 0; i < n.args.size(); i++)
+        explain_node(*n.args[i], depth + 1, stats);
+}
+
+// Check the expression with muparser, reporting errors like muparser does,
+// and build its tree. Returns 0 on success, 1 for errors, and 2 if the tree
+// is not available for this syntax.
+static int explain_tree(const std::string& expr, const ErrorContext& context, std::vector<ExprNodePtr>& roots)
+{
+    VarList vars;
+    double last_result = 0.0;
+    mu::Parser parser;
+    init_parser(parser, &vars, &last_result);
+    try {
+        parser.SetExpr(expr);
+        parser.Eval();
+    }
+    catch (mu::Parser::exception_type& e) {
+        Arena arena;
+        format_error(e, context, arena);
+        fwrite(arena.data(), 1, arena.size(), stderr);
+        return 1;
+    }
+    ExprParser expr_parser(expr);
+    if (!expr_parser.parse(roots))
+        return 2;
+    for (size_t i = 0; i < roots.size(); i++)
+        fold_constants(roots[i], expr, parser);
+    return 0;
+}
+
+static int explain(const std::string& expr, const ErrorContext& context)
+{
+    std::vector<ExprNodePtr> roots;
+    int status = explain_tree(expr, context, roots);
+    if (status == 1)
+        return 1;
+    printf("Expression: %s\n", expr.c_str());
+    if (status == 2) {
+        printf("Tree: not available for this syntax\n");
+        return 0;
+    }
+    ExplainStats stats;
+    printf("Tree after constant folding:\n");
+    bool has_assignment = false;
+    for (size_t i = 0; i < roots.size(); i++) {
+        explain_node(*roots[i], 0, stats);
+        has_assignment = has_assignment || (roots[i]->kind == ExprNode::Assignment);
+    }
+    has_assignment = has_assignment || analyze_expr(expr).has_assignment;
+
+    printf("Variables:");
+    for (size_t i = 0; i < stats.variables.size(); i++)
+        printf("%s %s", i > 0 ? "," : "", stats.variables[i].c_str());
+    printf("%s\n", stats.variables.empty() ? " none" : "");
+    printf("Constants: %d, of which %d folded\n", stats.constants, stats.folded);
+    if (stats.impure_functions.empty() && !has_assignment) {
+        printf("Pure: yes, the results depend only on the variables\n");
+    } else {
+        printf("Pure: no,");
+        for (size_t i = 0; i < stats.impure_functions.size(); i++)
+            printf("%s %s", i > 0 ? "," : "", stats.impure_functions[i].c_str());
+        printf("%s%s\n", !stats.impure_functions.empty() && has_assignment ? "," : "",
+                has_assignment ? " assigns variables" : "");
+    }
+
+    // Operation costs, measured relative to loading a variable
+    std::vector<std::string> bench_names;
+    bench_names.push_back("a");
+    bench_names.push_back("b");
+    bench_names.push_back("c");
+    double base = explain_measure("a", bench_names);
+    double estimate = base;
+    printf("Operations (count, kind, measured cost per operation):\n");
+    for (std::map<std::string, int>::const_iterator it = stats.kinds.begin(); it != stats.kinds.end(); ++it) {
+        double cost = explain_measure(it->first, bench_names) - base;
+        if (std::isnan(cost)) {
+            printf("  %6d  %-20s\n", it->second, it->first.c_str());
+            continue;
+        }
+        cost = std::max(cost, 0.0);
+        estimate += it->second * cost;
+        printf("  %6d  %-20s %8.2f ns\n", it->second, it->first.c_str(), cost);
+    }
+    if (stats.unmeasured > 0)
+        printf("  %6d  assignments and lookups (not measured)\n", stats.unmeasured);
+    printf("Estimated cost: %.2f ns per evaluation\n", estimate);
+    // Measure the whole expression if it can run in bulk mode
+    if (!has_assignment && stats.unmeasured == 0) {
+        double measured = explain_measure(expr, stats.variables);
+        if (!std::isnan(measured))
+            printf("Measured cost: %.2f ns per evaluation\n", measured);
+    }
+    return 0;
+}
+
+/* operator-level profile */
+
+// --profile-ops attributes the evaluation time of an expression to its
+// operators and function calls. Each subexpression is timed in muparser's
+// bulk mode; the self time of an operation is the time of its subexpression
+// minus the times of its operand subexpressions, and the loop overhead of
+// bulk mode, measured as the time of a plain variable, is attributed to the
+// expression itself. The self times are therefore differential estimates,
+// not measurements, and small ones are dominated by timing noise; each
+// subexpression time is the median of several timings to keep them stable.
+// The result is printed in the folded stack format of flame graph tools,
+// "expression;op;op count", with counts in nanoseconds per 1000
+// evaluations, and summarized by operation on stderr.
+static const int profile_repeats = 5;
+
+// Median of several explain_measure() timings; NaN if the expression fails
+static double profile_measure(const std::string& expr, const std::vector<std::string>& names)
+{
+    std::vector<double> times(profile_repeats);
+    for (int i = 0; i < profile_repeats; i++) {
+        times[i] = explain_measure(expr, names);
+        if (std::isnan(times[i]))
+            return NAN;
+    }
+    std::nth_element(times.begin(), times.begin() + profile_repeats / 2, times.end());
+    return times[profile_repeats / 2];
+}
+
+static std::string profile_frame(const ExprNode& n)
+{
+    if (n.kind == ExprNode::Operator && n.args.size() == 1)
+        return "neg";
+    return n.name;
+}
+
+// Collect the variable names; returns false for assignments
+static bool profile_variables(const ExprNode& n, std::vector<std::string>& names)
+{
+    if (n.kind == ExprNode::Assignment)
+        return false;
+    if (n.kind == ExprNode::Variable && std::find(names.begin(), names.end(), n.name) == names.end())
+        names.push_back(n.name);
+    for (size_t i = 0; i < n.args.size(); i++)
+        if (!profile_variables(*n.args[i], names))
+            return false;
+    return true;
+}
+
+static bool profile_node(const std::string& expr, const ExprNode& n, const std::string& stack,
+        const std::vector<std::string>& names, double overhead, double total,
+        std::map<std::string, double>& by_operation)
+{
+    // the time of the subexpression without the loop overhead
+    double self = total;
+    for (size_t i = 0; i < n.args.size(); i++) {
+        const ExprNode& arg = *n.args[i];
+        if (arg.kind != ExprNode::Operator && arg.kind != ExprNode::Function
+                && arg.kind != ExprNode::Conditional)
+            continue;   // constants and variables are part of the operation
+        double arg_total = profile_measure(expr.substr(arg.begin, arg.end - arg.begin), names);
+        if (std::isnan(arg_total))
+            return false;
+        arg_total = std::max(arg_total - overhead, 0.0);
+        self -= arg_total;
+        if (!profile_node(expr, arg, stack + ";" + profile_frame(arg), names, overhead, arg_total, by_operation))
+            return false;
+    }
+    self = std::max(self, 0.0);
+    printf("%s %.0f\n", stack.c_str(), self * 1000.0);
+    by_operation[profile_frame(n)] += self;
+    return true;
+}
+
+static int profile_ops(const std::string& expr, const ErrorContext& context)
+{
+    std::vector<ExprNodePtr> roots;
+    int status = explain_tree(expr, context, roots);
+    if (status == 1)
+        return 1;
+    std::vector<std::string> names;
+    bool supported = (status == 0);
+    for (size_t i = 0; i < roots.size() && supported; i++)
+        supported = profile_variables(*roots[i], names);
+    double overhead = (supported ? profile_measure(names.empty() ? std::string("0") : names[0], names) : NAN);
+    double total = (supported ? profile_measure(expr, names) : NAN);
+    if (std::isnan(overhead) || std::isnan(total)) {
+        Arena arena;
+        format_error_prefix(context, arena);
+        arena.append(supported ? "evaluation in bulk mode failed\n"
+                : "cannot profile expressions with assignments or unsupported syntax\n");
+        fwrite(arena.data(), 1, arena.size(), stderr);
+        return 1;
+    }
+    // flame graph tools skip lines that are not stacks
+    printf("# differential estimates: subexpression time minus operand times, median of %d timings\n",
+            profile_repeats);
+    std::map<std::string, double> by_operation;
+    double roots_total = 0.0;
+    for (size_t i = 0; i < roots.size(); i++) {
+        const ExprNode& root = *roots[i];
+        if (root.kind != ExprNode::Operator && root.kind != ExprNode::Function
+                && root.kind != ExprNode::Conditional)
+            continue;
+        double root_total = (roots.size() == 1 ? total - overhead
+                : profile_measure(expr.substr(root.begin, root.end - root.begin), names) - overhead);
+        root_total = std::max(root_total, 0.0);
+        roots_total += root_total;
+        if (!profile_node(expr, root, expr + ";" + profile_frame(root), names, overhead, root_total, by_operation))
+            return 1;
+    }
+    // the loop overhead, variable loads, and anything not attributed
+    printf("%s %.0f\n", expr.c_str(), std::max(total - roots_total, 0.0) * 1000.0);
+
+    fprintf(stderr, "Profile: %s: %.2f ns per evaluation\n", expr.c_str(), total);
+    fprintf(stderr, "Profile: self times are differential estimates (median of %d timings), not measurements\n",
+            profile_repeats);
+    std::vector<std::pair<double, std::string>> sorted;
+    for (std::map<std::string, double>::const_iterator it = by_operation.begin(); it != by_operation.end(); ++it)
+        sorted.push_back(std::make_pair(it->second, it->first));
+    std::sort(sorted.rbegin(), sorted.rend());
+    for (size_t i = 0; i < sorted.size(); i++) {
+        fprintf(stderr, "Profile: %8.2f ns %5.1f%%  %s\n", sorted[i].first,
+                total > 0.0 ? 100.0 * sorted[i].first / total : 0.0, sorted[i].second.c_str());
+    }
+    return 0;
+}
+
+/* main() */
+
+void print_short_version()
+{
+    printf("mucalc version 2.1 -- see <https://marlam.de/mucalc>\n");
+}
+
+void print_short_help()
+{
+    printf("Type an expression, 'help', or 'quit'.\n");
+}
+
+void print_core_help()
+{
+    printf("Evaluates mathematical expression(s) and prints the results.\n");
+    printf("Expressions can be given as arguments, read from an input stream, or\n");
+    printf("typed interactively.\n");
+    printf("The evaluation is handled by muparser <https://beltoforion.de/en/muparser/>.\n");
+    printf("Variables can be used without explicit declaration. Separating multiple\n");
+    printf("expressions with commas is supported.\n");
+    printf("The last result is available in a special variable named '_'.\n");
+    printf("In interactive mode, slow evaluations continue in the background; use\n");
+    printf("'jobs' to list them and 'cancel <id>' or 'cancel all' to cancel them.\n");
+    printf("Huge lists and sum(), avg(), and med() stop when canceled; other running\n");
+    printf("evaluations cannot be stopped, and later jobs wait for them. The\n");
+    printf("command 'preview' toggles a live preview of the result while typing.\n");
+    printf("'vars' lists the variables, 'vars --stats' reports their number and memory\n");
+    printf("use, 'unset <name...>' removes variables, and 'clear' removes all of them.\n");
+    printf("Available constants:\n");
+    printf("  pi, e\n");
+    printf("Available functions:\n");
+    printf("  deg, rad,\n");
+    printf("  sin, asin, cos, acos, tan, atan, atan2,\n");
+    printf("  sinh, asinh, cosh, acosh, tanh, atanh,\n");
+    printf("  pow, exp, exp2, exp10, log, ln, log2, log10, sqrt, cbrt,\n");
+    printf("  abs, sign, fract, int, ceil, floor, round, rint, trunc,\n");
+    printf("  min, max, sum, avg, med,\n");
+    printf("  clamp, step, smoothstep, mix,\n");
+    printf("  erf, erfc, tgamma, lgamma, beta, normcdf, norminv,\n");
+    printf("  sobol, halton, lookup,\n");
+    printf("  seed, random, gaussian,\n");
+    printf("  exponential, poisson, binomial, gamma, discrete\n");
+    printf("Available operators:\n");
+    printf("  ^, *, /, %%, +, -, ==, !=, <, >, <=, >=, ||, &&, ?:\n");
+    printf("Expression examples:\n");
+    printf("  sin(pi/2)\n");
+    printf("  sin(rad(90))\n");
+    printf("  a = 2^3 + 2\n");
+    printf("  b = sqrt(49) * 2 + 6\n");
+    printf("  sin(2 * pi) + a * b / log10(a^(b/4)) + cos(rad(12*(a+b))) + sign(a)\n");
+}
+
+/* interactive mode */
+
+#if !(defined(_WIN32) || defined(_WIN64))
+# define MUCALC_BACKGROUND_JOBS
+#endif
+
+#ifdef MUCALC_BACKGROUND_JOBS
+
+// In interactive mode, expressions are evaluated as jobs on a background
+// thread, in the order in which they are entered, so that the prompt stays
+// usable while a slow computation runs. The prompt waits a moment for each
+// job, so fast results appear just like before. Jobs that take longer keep
+// running in the background and their results are printed when available;
+// the job thread announces finished jobs through a pipe that the main loop
+// watches together with standard input.
+class JobRunner
+{
+public:
+    struct Job
+    {
+        int id;
+        std::string expr;
+        int status;
+        std::string text;   // results or errors, depending on status
+        bool background;    // whether the prompt stopped waiting for it
+    };
+
+private:
+    mu::Parser& _parser;
+    double* _last_result;
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _work_cond;
+    std::condition_variable _done_cond;
+    std::deque<Job> _waiting;
+    std::deque<Job> _finished;
+    Job _running;
+    bool _is_running;
+    bool _running_canceled;
+    std::atomic<bool> _cancel;  // interrupts the running evaluation
+    int _next_id;
+    bool _quit;
+    int _wakeup_pipe[2];
+
+    void thread_main()
+    {
+        eval_cancel_flag = &_cancel;
+        Arena arena;
+        for (;;) {
+            std::string expr;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _work_cond.wait(lock, [&]() { return _quit || !_waiting.empty(); });
+                if (_quit)
+                    break;
+                _running = _waiting.front();
+                _waiting.pop_front();
+                _is_running = true;
+                _running_canceled = false;
+                _cancel = false;
+                expr = _running.expr;
+            }
+            arena.reset();
+            double result;
+            int status;
+            {
+                std::lock_guard<std::mutex> vars_lock(added_vars_mutex);
+                status = eval_main(_parser, &result, expr, ErrorContext(), arena);
+            }
+            {
+                // _ is read by other threads under added_vars_mutex
+                std::lock_guard<std::mutex> vars_lock(added_vars_mutex);
+                std::lock_guard<std::mutex> lock(_mutex);
+                _is_running = false;
+                if (!_running_canceled) {
+                    if (status == 0)
+                        *_last_result = result;
+                    _running.status = status;
+                    _running.text.assign(arena.data(), arena.size());
+                    _finished.push_back(_running);
+                }
+            }
+            _done_cond.notify_all();
+            char c = 0;
+            if (write(_wakeup_pipe[1], &c, 1) != 1) {
+                // the main loop will still find the job on the next wakeup
+            }
+        }
+    }
+
+public:
+    JobRunner(mu::Parser& parser, double* last_result) :
+        _parser(parser), _last_result(last_result),
+        _is_running(false), _running_canceled(false), _cancel(false), _next_id(1), _quit(false)
+    {
+        if (pipe(_wakeup_pipe) != 0
+                || fcntl(_wakeup_pipe[0], F_SETFL, fcntl(_wakeup_pipe[0], F_GETFL) | O_NONBLOCK) != 0) {
+            fprintf(stderr, "%s\n", strerror(errno));
+            exit(1);
+        }
+        _thread = std::thread(&JobRunner::thread_main, this);
+    }
+
+    // Stops after the running job finishes; waiting jobs are discarded
+    ~JobRunner()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _quit = true;
+        }
+        _work_cond.notify_one();
+        _thread.join();
+        close(_wakeup_pipe[0]);
+        close(_wakeup_pipe[1]);
+    }
+
+    int wakeup_fd() const
+    {
+        return _wakeup_pipe[0];
+    }
 
-/* muparser custom constants */
+    int submit(const std::string& expr)
+    {
+        Job job;
+        job.status = 0;
+        job.expr = expr;
+        job.background = false;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            job.id = _next_id++;
+            _waiting.push_back(job);
+        }
+        _work_cond.notify_one();
+        return job.id;
+    }
 
-static const double e = 2.7182818284590452353602874713526625;
-static const double pi = 3.1415926535897932384626433832795029;
+    // Wait for the given job to finish. Returns false if it did not finish
+    // in time; it then counts as a background job.
+    bool wait(int id, int milliseconds)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto finished = [&]() {
+            for (size_t i = 0; i < _finished.size(); i++)
+                if (_finished[i].id == id)
+                    return true;
+            return false;
+        };
+        if (_done_cond.wait_for(lock, std::chrono::milliseconds(milliseconds), finished))
+            return true;
+        if (_is_running && _running.id == id)
+            _running.background = true;
+        for (size_t i = 0; i < _waiting.size(); i++)
+            if (_waiting[i].id == id)
+                _waiting[i].background = true;
+        return false;
+    }
 
-/* muparser custom operators */
+    std::deque<Job> take_finished()
+    {
+        char buf[64];
+        while (read(_wakeup_pipe[0], buf, sizeof(buf)) > 0);
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::deque<Job> finished;
+        finished.swap(_finished);
+        return finished;
+    }
 
-static double mod(double x, double y)
-{
-    return x - y * floor(x / y);
-}
+    void print_jobs()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_is_running && !_running_canceled)
+            printf("[%d] running  %s\n", _running.id, _running.expr.c_str());
+        for (size_t i = 0; i < _waiting.size(); i++)
+            printf("[%d] waiting  %s\n", _waiting[i].id, _waiting[i].expr.c_str());
+    }
 
-/* muparser custom functions */
+    // Cancel a job (or all jobs if id is 0). Waiting jobs are removed. The
+    // evaluation of a running job is interrupted where it checks the cancel
+    // flag (see eval_cancel_flag); otherwise it runs to its end, and later
+    // jobs wait for it. Its result is discarded in any case.
+    int cancel(int id)
+    {
+        int canceled = 0;
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_is_running && !_running_canceled && (id == 0 || _running.id == id)) {
+            _running_canceled = true;
+            _cancel = true;
+            canceled++;
+        }
+        for (size_t i = 0; i < _waiting.size(); ) {
+            if (id == 0 || _waiting[i].id == id) {
+                _waiting.erase(_waiting.begin() + i);
+                canceled++;
+            } else {
+                i++;
+            }
+        }
+        return canceled;
+    }
+};
 
-static double deg(double x)
+static void print_job(const JobRunner::Job& job)
 {
-    return x * 180.0 / pi;
+    if (job.background)
+        printf("[%d] %s\n", job.id, job.expr.c_str());
+    fflush(stdout);
+    fwrite(job.text.data(), 1, job.text.size(), job.status == 0 ? stdout : stderr);
+    fflush(job.status == 0 ? stdout : stderr);
 }
 
-static double rad(double x)
+// Print finished jobs while readline is showing the prompt: the current
+// input line is hidden, the results are printed, and then prompt and input
+// line are redisplayed.
+static void print_jobs_async(const std::deque<JobRunner::Job>& jobs)
 {
-    return x * pi / 180.0;
+    if (jobs.empty())
+        return;
+    char* saved_line = rl_copy_text(0, rl_end);
+    int saved_point = rl_point;
+    rl_set_prompt("");
+    rl_replace_line("", 0);
+    rl_redisplay();
+    for (size_t i = 0; i < jobs.size(); i++)
+        print_job(jobs[i]);
+    rl_set_prompt("> ");
+    rl_replace_line(saved_line, 0);
+    rl_point = saved_point;
+    rl_redisplay();
+    free(saved_line);
 }
 
-static double int_(double x)
+#endif
+
+struct Interactive
 {
-    return (int)x;
-}
+#ifdef MUCALC_BACKGROUND_JOBS
+    JobRunner* jobs;
+#endif
+    mu::Parser* parser;
+    double* last_result;
+    int* retval;
+    bool quit;
+    bool quit_via_control_d;
+};
 
-static double fract(double x)
+static Interactive interactive;
+
+/* live preview in interactive mode */
+
+// With the preview enabled, the current input line is evaluated on each
+// change and its result is shown in the line below the prompt. The preview
+// uses its own parser with copies of the variables of the main parser and
+// never modifies them: lines with assignments or impure functions and lines
+// that use unknown variables are not previewed. Previews are cached per input
+// text until the variables change, so that editing back and forth (e.g.
+// with backspace) does not evaluate again.
+// The evaluation runs on a preview thread, so that a slow expression blocks
+// neither the prompt nor the job thread. The prompt waits for the result for
+// a short time only; a result that arrives later is shown from the cache on
+// the next change of the input line.
+struct Preview
 {
-    return x - floor(x);
-}
+    bool enabled;
+    bool shown;                 // whether the line below the prompt is in use
+    std::string text;           // input text of the current preview
+    unsigned long var_generation; // of the main parser variables...
+    unsigned long copy_generation; // ... and of the copies sent to the thread
+    std::map<std::string, std::string> cache;
+
+    // Shared with the preview thread
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool quit;
+    bool has_request;
+    std::string request;        // input to evaluate next
+    unsigned long request_generation;
+    bool has_request_vars;
+    std::vector<std::pair<std::string, double>> request_vars; // new variable copies
+    bool has_result;
+    std::string result_input;
+    std::string result;
+    unsigned long result_generation;
+    bool result_cacheable;
 
-static double med(const double* x, int n)
+    // Used by the preview thread only
+    mu::Parser parser;
+    VarList unknown_vars;       // created when the preview uses unknown names
+    std::vector<std::pair<std::string, double>> vars;
+    std::deque<double> values;  // the variable copies, with stable addresses
+    double last_result;
+    Arena arena;
+
+    Preview() : enabled(false), shown(false), var_generation(1), copy_generation(0),
+        quit(false), has_request(false), request_generation(0), has_request_vars(false),
+        has_result(false), result_generation(0), result_cacheable(false), last_result(0.0)
+    {
+    }
+};
+
+static Preview preview;
+
+static void preview_thread_main()
 {
-    std::vector<double> values(x, x + n);
-    std::sort(values.begin(), values.end());
-    if (n % 2 == 1) {
-        return values[n / 2];
-    } else {
-        return (values[n / 2 - 1] + values[n / 2]) / 2.0;
+    std::unique_lock<std::mutex> lock(preview.mutex);
+    for (;;) {
+        preview.cond.wait(lock, []() { return preview.quit || preview.has_request; });
+        if (preview.quit)
+            break;
+        std::string input;
+        input.swap(preview.request);
+        unsigned long generation = preview.request_generation;
+        bool new_vars = preview.has_request_vars;
+        if (new_vars)
+            preview.vars.swap(preview.request_vars);
+        preview.has_request = false;
+        preview.has_request_vars = false;
+        lock.unlock();
+
+        if (new_vars || !preview.unknown_vars.empty()) {
+            preview.parser.ClearVar();
+            preview.unknown_vars.clear();
+            preview.values.clear();
+            for (size_t i = 0; i < preview.vars.size(); i++) {
+                if (preview.vars[i].first == "_") {
+                    preview.last_result = preview.vars[i].second;
+                    preview.parser.DefineVar("_", &preview.last_result);
+                } else {
+                    preview.values.push_back(preview.vars[i].second);
+                    preview.parser.DefineVar(preview.vars[i].first, &preview.values.back());
+                }
+            }
+        }
+        std::string result;
+        preview.arena.reset();
+        double dummy;
+        if (eval(preview.parser, &dummy, input, ErrorContext(), preview.arena) == 0 && preview.unknown_vars.empty()) {
+            result.assign("= ");
+            result.append(preview.arena.data(), preview.arena.size() - 1); // without newline
+        }
+
+        lock.lock();
+        preview.result_input.swap(input);
+        preview.result.swap(result);
+        preview.result_generation = generation;
+        preview.result_cacheable = preview.unknown_vars.empty();
+        preview.has_result = true;
+        preview.cond.notify_all();
     }
 }
 
-static double clamp(double x, double minval, double maxval)
+static void preview_start()
 {
-    return std::min(maxval, std::max(minval, x));
+    init_parser(preview.parser, &preview.unknown_vars, &preview.last_result);
+    preview.thread = std::thread(preview_thread_main);
 }
 
-static double step(double x, double edge)
+// Waits for the preview evaluation that is in progress, if any
+static void preview_stop()
 {
-    return (x < edge ? 0.0 : 1.0);
+    {
+        std::lock_guard<std::mutex> lock(preview.mutex);
+        preview.quit = true;
+    }
+    preview.cond.notify_all();
+    preview.thread.join();
 }
 
-static double smoothstep(double x, double edge0, double edge1)
+// Move a finished preview evaluation into the cache, unless the variables
+// changed in the meantime. Called with preview.mutex locked.
+static void preview_take_result()
 {
-    double t = clamp((x - edge0) / (edge1 - edge0), 0.0, 1.0);
-    return t * t * (3.0 - t * 2.0);
+    if (!preview.has_result)
+        return;
+    preview.has_result = false;
+    if (preview.result_generation == preview.var_generation && preview.result_cacheable) {
+        if (preview.cache.size() >= 1000)
+            preview.cache.clear();
+        preview.cache[preview.result_input] = preview.result;
+    }
 }
 
-static double mix(double x, double y, double t)
+// Evaluate the given input for the preview; returns an empty string if there
+// is nothing to show or if the evaluation takes too long
+static std::string preview_eval(const std::string& input)
 {
-    return x * (1.0 - t) + y * t;
+    if (input.find_first_not_of(' ') == std::string::npos)
+        return std::string();
+    ExprInfo info = analyze_expr(input);
+    if (info.has_assignment || info.uses_impure_functions)
+        return std::string();
+    std::unique_lock<std::mutex> lock(preview.mutex);
+    preview_take_result();
+    std::map<std::string, std::string>::const_iterator it = preview.cache.find(input);
+    if (it != preview.cache.end())
+        return it->second;
+    if (preview.copy_generation != preview.var_generation) {
+        // Copy the current variables of the main parser, but do not wait for
+        // a running job that might be changing them
+        std::unique_lock<std::mutex> vars_lock(added_vars_mutex, std::try_to_lock);
+        if (!vars_lock.owns_lock())
+            return std::string();
+        preview.request_vars.clear();
+        preview.request_vars.push_back(std::make_pair(std::string("_"), *interactive.last_result));
+        for (size_t i = 0; i < added_vars.size(); i++)
+            preview.request_vars.push_back(std::make_pair(added_vars[i].first, *(added_vars[i].second)));
+        preview.has_request_vars = true;
+        preview.copy_generation = preview.var_generation;
+    }
+    preview.request = input;
+    preview.request_generation = preview.var_generation;
+    preview.has_request = true;
+    preview.cond.notify_all();
+    auto finished = [&]() {
+        return preview.has_result && preview.result_input == input
+            && preview.result_generation == preview.var_generation;
+    };
+    if (!preview.cond.wait_for(lock, std::chrono::milliseconds(50), finished))
+        return std::string();
+    std::string result = preview.result;
+    preview_take_result();
+    return result;
 }
 
-static double unary_plus(double x)
+// Show the text in the line below the prompt (or clear that line if the text
+// is empty), and return the cursor to its position in the input line
+static void preview_show(const std::string& text)
 {
-    return x;
+    if (text.empty() && !preview.shown)
+        return;
+    int rows, cols;
+    rl_get_screen_size(&rows, &cols);
+    int cursor_col = strlen(rl_display_prompt) + rl_point;
+    if (cols <= 1 || static_cast<int>(strlen(rl_display_prompt)) + rl_end >= cols)
+        return; // the input line wraps; keep things simple
+    fputs("\r\n\033[2K", rl_outstream);
+    fwrite(text.data(), 1, std::min(text.size(), static_cast<size_t>(cols - 1)), rl_outstream);
+    fputs("\033[1A\r", rl_outstream);
+    if (cursor_col > 0)
+        fprintf(rl_outstream, "\033[%dC", cursor_col);
+    fflush(rl_outstream);
+    preview.shown = !text.empty();
 }
 
-static std::mt19937_64 prng;
-static std::uniform_real_distribution<double> uniform_distrib(0.0, 1.0);
-static std::normal_distribution<double> gaussian_distrib(0.0, 1.0);
-
-static double seed(double x)
+static void preview_redisplay()
 {
-    prng.seed(x);
-    return 0.0;
+    rl_redisplay();
+    std::string input(rl_line_buffer, rl_end);
+    if (input != preview.text) {
+        preview.text = input;
+        preview_show(preview_eval(input));
+    }
 }
 
-static double random_()
+static void preview_enable(bool enable)
 {
-    return uniform_distrib(prng);
+    preview.enabled = enable;
+    preview.text.clear();
+    rl_redisplay_function = (enable ? preview_redisplay : rl_redisplay);
 }
 
-static double gaussian()
+// Called after the input line was accepted: readline has moved the cursor to
+// the line below the prompt, which is cleared for the output
+static void preview_line_accepted()
 {
-    return gaussian_distrib(prng);
+    if (preview.shown) {
+        fputs("\033[2K\r", rl_outstream);
+        fflush(rl_outstream);
+        preview.shown = false;
+    }
+    preview.text.clear();
 }
 
-/* muparser implicit variable definitions */
-
-static std::vector<std::pair<std::string, std::unique_ptr<double>>> added_vars;
-
-static double* add_var(const char* name, void* /* data */)
+// Called whenever variables of the main parser may have changed
+static void preview_invalidate()
 {
-    added_vars.push_back(std::make_pair(
-                std::string(name), std::unique_ptr<double>(new double(0.0))));
-    return added_vars.back().second.get();
+    preview.var_generation++;
+    preview.cache.clear();
+    preview.text.clear();
 }
 
-/* muparser evaluation of an expression and printing of result */
-
-static int eval_and_print(mu::Parser& parser,
-        double* last_result,
-        const std::string& expr,
-        const std::string& errmsg_prefix = std::string())
+// The commands vars, vars --stats, unset, and clear
+static void interactive_vars_command(const std::string& line)
 {
-    int retval = 0;
-    try {
-        parser.SetExpr(expr);
-        int n;
-        double* results = parser.Eval(n);
-        for (int j = 0; j < n; j++) {
-            printf("%.12g%s", results[j], j == n - 1 ? "\n" : ", ");
+    // Variables cannot change while a job is using them
+    std::unique_lock<std::mutex> lock(added_vars_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        fprintf(stderr, "Variables are in use by a running job\n");
+        return;
+    }
+    mu::Parser& parser = *interactive.parser;
+    if (line == "vars") {
+        for (size_t i = 0; i < added_vars.size(); i++)
+            printf("%s = %.12g\n", added_vars[i].first.c_str(), *(added_vars[i].second));
+        for (size_t i = 0; i < added_params.size(); i++)
+            printf("%s = %.12g (parameter)\n", added_params[i].first.c_str(),
+                    *param_store.find(added_params[i].first.c_str()));
+    } else if (line == "vars --stats") {
+        printf("%zu variables, %zu free cells, about %zu bytes\n",
+                added_vars.size(), added_vars.free_cells(), added_vars.memory());
+        if (param_store.size() > 0)
+            printf("%zu of %zu parameters in use\n", added_params.size(), param_store.size());
+    } else if (line == "clear") {
+        for (size_t i = 0; i < added_vars.size(); i++)
+            parser.RemoveVar(added_vars[i].first);
+        added_vars.clear();
+        // parameters get their values from the store back
+        for (size_t i = 0; i < added_params.size(); i++) {
+            *param_store.find(added_params[i].first.c_str()) = added_params[i].second;
+            parser.RemoveVar(added_params[i].first);
         }
-        if (n > 0) {
-            *last_result = results[0];
+        added_params.clear();
+        preview_invalidate();
+    } else {
+        // unset name...
+        size_t p = 5;
+        for (;;) {
+            size_t start = line.find_first_not_of(' ', p);
+            if (start == std::string::npos)
+                break;
+            p = line.find(' ', start);
+            std::string name = line.substr(start, p == std::string::npos ? p : p - start);
+            std::vector<std::pair<std::string, double>>::iterator param = added_params.begin();
+            while (param != added_params.end() && param->first != name)
+                ++param;
+            if (name == "_") {
+                fprintf(stderr, "Cannot unset _\n");
+            } else if (added_vars.remove(name)) {
+                parser.RemoveVar(name);
+            } else if (param != added_params.end()) {
+                *param_store.find(name.c_str()) = param->second;
+                parser.RemoveVar(name);
+                added_params.erase(param);
+            } else if (param_store.find(name.c_str())) {
+                // an unused parameter has its value from the store already
+            } else {
+                fprintf(stderr, "No such variable: %s\n", name.c_str());
+            }
+            if (p == std::string::npos)
+                break;
         }
+        preview_invalidate();
     }
-    catch (mu::Parser::exception_type& e) {
-        // Fix up the exception before reporting the error
-        mu::string_type expr = e.GetExpr();
-        mu::string_type token = e.GetToken();
-        mu::EErrorCodes code = e.GetCode();
-        size_t pos = e.GetPos();
-        // Let positions start at 1 and fix position reported for EOF
-        if (code != mu::ecUNEXPECTED_EOF)
-            pos++;
-        if (pos == 0)
-            pos = 1;
-        // Remove excess blank from token
-        if (token.back() == ' ')
-            token.pop_back();
-        mu::Parser::exception_type fixed_err(code, pos, token);
-        // Report the fixed error
-        if (errmsg_prefix.length() > 0)
-            fprintf(stderr, "%s: ", errmsg_prefix.c_str());
-        fprintf(stderr, "%s\n", fixed_err.GetMsg().c_str());
-        fprintf(stderr, "%s\n", expr.c_str());
-        std::string blanks(fixed_err.GetPos() - 1, ' ');
-        fprintf(stderr, "%s^\n", blanks.c_str());
-        retval = 1;
-    }
-    return retval;
 }
 
-/* readline custom completion */
-
-char* xstrdup(const char *s)
+static void interactive_quit()
 {
-    char* p = strdup(s);
-    if (!p) {
-        fputs(strerror(ENOMEM), stderr);
-        fputc('\n', stderr);
-        exit(1);
-    }
-    return p;
+    interactive.quit = true;
+#ifdef MUCALC_BACKGROUND_JOBS
+    // remove the handler here so that readline does not show another prompt
+    rl_callback_handler_remove();
+#endif
 }
 
-static const char* constant_names[] = {
-    "pi", "e",
-    NULL
-};
-
-static const char* function_names[] = {
-    "deg", "rad",
-    "sin", "asin", "cos", "acos", "tan", "atan", "atan2",
-    "sinh", "asinh", "cosh", "acosh", "tanh", "atanh",
-    "pow", "exp", "exp2", "exp10", "log", "ln", "log2", "log10",
-    "sqrt", "cbrt", "abs", "sign",
-    "fract", "int", "ceil", "floor", "round", "rint", "trunc",
-    "min", "max", "sum", "avg", "med",
-    "clamp", "step", "smoothstep", "mix",
-    "seed", "random", "gaussian",
-    NULL
-};
-
-static char* completion_generator(const char* text, int state)
+static void interactive_line_handler(char* line)
 {
-    static int functions_index, constants_index, variables_index, len;
-    if (state == 0) {
-        functions_index = 0;
-        constants_index = 0;
-        variables_index = 0;
-        len = strlen(text);
-    }
-
-    const char* name;
-    // first complete function names...
-    while ((name = function_names[functions_index])) {
-        functions_index++;
-        if (strncmp(name, text, len) == 0)
-            break;
-    }
-    if (name) {
-        rl_completion_append_character = '(';
-        return xstrdup(name);
-    }
-    // ... then constant names...
-    while ((name = constant_names[constants_index])) {
-        constants_index++;
-        if (strncmp(name, text, len) == 0)
-            break;
+    if (!line) {
+        interactive_quit();
+        return;
     }
-    if (name) {
-        rl_completion_append_character = ' ';
-        return xstrdup(name);
+    preview_line_accepted();
+    std::string string_line = line;
+    std::string trimmed_line;
+    size_t first_nonspace = string_line.find_first_not_of(' ');
+    if (first_nonspace != std::string::npos) {
+        size_t last_nonspace = string_line.find_last_not_of(' ');
+        trimmed_line = string_line.substr(first_nonspace, last_nonspace - first_nonspace + 1);
     }
-    // ... and finally variable names.
-    while (static_cast<size_t>(variables_index) < added_vars.size()) {
-        name = added_vars[variables_index].first.c_str();
-        variables_index++;
-        if (strncmp(name, text, len) == 0)
-            break;
-        name = NULL;
+    if (!trimmed_line.empty())
+        add_history(line);
+    if (trimmed_line.empty()) {
+        print_short_help();
+    } else if (trimmed_line == "help" || trimmed_line == "?") {
+        print_core_help();
+    } else if (trimmed_line == "quit" || trimmed_line == "exit") {
+        interactive_quit();
+        interactive.quit_via_control_d = false;
+    } else if (trimmed_line == "unset") {
+        fprintf(stderr, "Usage: unset <name...>\n");
+    } else if (trimmed_line == "vars" || trimmed_line == "vars --stats" || trimmed_line == "clear"
+            || trimmed_line.compare(0, 6, "unset ") == 0) {
+        interactive_vars_command(trimmed_line);
+    } else if (trimmed_line == "preview") {
+        preview_enable(!preview.enabled);
+        printf("Preview %s\n", preview.enabled ? "on" : "off");
+#ifdef MUCALC_BACKGROUND_JOBS
+    } else if (trimmed_line == "jobs") {
+        interactive.jobs->print_jobs();
+    } else if (trimmed_line == "cancel" || trimmed_line.compare(0, 7, "cancel ") == 0) {
+        const char* arg = trimmed_line.c_str() + 6;
+        while (*arg == ' ')
+            arg++;
+        char* end;
+        long id = strtol(arg, &end, 10);
+        if (strcmp(arg, "all") == 0)
+            id = 0;
+        else if (end == arg || *end != '\0' || id <= 0 || id > INT_MAX)
+            id = -1;
+        if (id < 0)
+            fprintf(stderr, "Usage: cancel <id> | cancel all\n");
+        else if (interactive.jobs->cancel(id) == 0)
+            fprintf(stderr, "No such job\n");
+    } else {
+        int id = interactive.jobs->submit(line);
+        if (!interactive.jobs->wait(id, 200))
+            printf("[%d] running in the background\n", id);
+        std::deque<JobRunner::Job> finished = interactive.jobs->take_finished();
+        for (size_t i = 0; i < finished.size(); i++) {
+            print_job(finished[i]);
+            *interactive.retval = finished[i].status;
+        }
+        if (!finished.empty())
+            preview_invalidate();
     }
-    if (name) {
-        rl_completion_append_character = ' ';
-        return xstrdup(name);
+#else
+    } else {
+        *interactive.retval = eval_and_print(*interactive.parser, interactive.last_result, line);
+        preview_invalidate();
     }
-    return NULL;
+#endif
+    free(line);
 }
 
-/* readline history file location */
-
-std::string history_file()
+static void interactive_loop(mu::Parser& parser, double* last_result, int* retval, bool enable_preview)
 {
-    static std::string histfile;
-    if (histfile.empty()) {
-#if defined(_WIN32) || defined(_WIN64)
-        const char* appdata = getenv("APPDATA");
-        if (appdata)
-            histfile = std::string(appdata) + '\\';
-        histfile += "mucalc_history.txt";
+    preview_start();
+    preview_enable(enable_preview);
+    interactive.parser = &parser;
+    interactive.last_result = last_result;
+    interactive.retval = retval;
+    interactive.quit = false;
+    interactive.quit_via_control_d = true;
+#ifndef MUCALC_BACKGROUND_JOBS
+    char* line;
+    while (!interactive.quit && (line = readline("> ")))
+        interactive_line_handler(line);
+    if (interactive.quit_via_control_d)
+        printf("^D\n");
 #else
-        const char* home = getenv("HOME");
-        if (home)
-            histfile = std::string(home) + '/';
-        histfile += ".mucalc_history";
-#endif
+    JobRunner jobs(parser, last_result);
+    interactive.jobs = &jobs;
+    rl_callback_handler_install("> ", interactive_line_handler);
+    while (!interactive.quit) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fileno(stdin), &fds);
+        FD_SET(jobs.wakeup_fd(), &fds);
+        int r = select(std::max(fileno(stdin), jobs.wakeup_fd()) + 1, &fds, NULL, NULL, NULL);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            interactive_quit();
+            break;
+        }
+        if (FD_ISSET(jobs.wakeup_fd(), &fds)) {
+            std::deque<JobRunner::Job> finished = jobs.take_finished();
+            if (!finished.empty())
+                preview_invalidate();
+            print_jobs_async(finished);
+            for (size_t i = 0; i < finished.size(); i++)
+                *retval = finished[i].status;
+        }
+        if (FD_ISSET(fileno(stdin), &fds))
+            rl_callback_read_char();
     }
-    return histfile;
-}
-
-/* main() */
-
-void print_short_version()
-{
-    printf("mucalc version 2.1 -- see <https://marlam.de/mucalc>\n");
+    if (interactive.quit_via_control_d)
+        printf("^D\n");
+    if (jobs.cancel(0) > 0)
+        printf("Waiting for the running job to finish\n");
+#endif
+    preview_stop();
 }
 
-void print_short_help()
+// Parse "N" or "MIN:MAX" with values in [lo, hi]
+static bool parse_range(const char* arg, long lo, long hi, long* min, long* max)
 {
-    printf("Type an expression, 'help', or 'quit'.\n");
+    char* end;
+    errno = 0;
+    *min = strtol(arg, &end, 10);
+    if (end == arg || errno != 0)
+        return false;
+    *max = *min;
+    if (*end == ':') {
+        const char* p = end + 1;
+        *max = strtol(p, &end, 10);
+        if (end == p || errno != 0)
+            return false;
+    }
+    return (*end == '\0' && *min >= lo && *max <= hi && *min <= *max);
 }
 
-void print_core_help()
+// Arguments that start with "--" but are not option names, such as "--5",
+// are expressions
+static bool is_option_name(const char* arg)
 {
-    printf("Evaluates mathematical expression(s) and prints the results.\n");
-    printf("Expressions can be given as arguments, read from an input stream, or\n");
-    printf("typed interactively.\n");
-    printf("The evaluation is handled by muparser <https://beltoforion.de/en/muparser/>.\n");
-    printf("Variables can be used without explicit declaration. Separating multiple\n");
-    printf("expressions with commas is supported.\n");
-    printf("The last result is available in a special variable named '_'.\n");
-    printf("Available constants:\n");
-    printf("  pi, e\n");
-    printf("Available functions:\n");
-    printf("  deg, rad,\n");
-    printf("  sin, asin, cos, acos, tan, atan, atan2,\n");
-    printf("  sinh, asinh, cosh, acosh, tanh, atanh,\n");
-    printf("  pow, exp, exp2, exp10, log, ln, log2, log10, sqrt, cbrt,\n");
-    printf("  abs, sign, fract, int, ceil, floor, round, rint, trunc,\n");
-    printf("  min, max, sum, avg, med,\n");
-    printf("  clamp, step, smoothstep, mix\n");
-    printf("  seed, random, gaussian\n");
-    printf("Available operators:\n");
-    printf("  ^, *, /, %%, +, -, ==, !=, <, >, <=, >=, ||, &&, ?:\n");
-    printf("Expression examples:\n");
-    printf("  sin(pi/2)\n");
-    printf("  sin(rad(90))\n");
-    printf("  a = 2^3 + 2\n");
-    printf("  b = sqrt(49) * 2 + 6\n");
-    printf("  sin(2 * pi) + a * b / log10(a^(b/4)) + cos(rad(12*(a+b))) + sign(a)\n");
+    static const char* const names[] = {
+        "--threads", "--batch-size", "--output-shards", "--grid", "--npy",
+        "--output", "--params", "--params-create", "--explain", "--profile-ops",
+        "--check-precision", "--preview", "--profile", "--pin-threads", "--columns",
+        "--lookup-cache"
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        if (strcmp(arg, names[i]) == 0)
+            return true;
+    return false;
 }
 
 int main(int argc, char *argv[])
@@ -343,55 +5742,297 @@ int main(int argc, char *argv[])
     if (argc == 2 && strcmp(argv[1], "--help") == 0) {
         print_short_version();
         printf("\n");
-        printf("Usage: mucalc [<expression...>]\n");
+        printf("Usage: mucalc [<option...>] [<expression...>]\n");
         printf("\n");
         print_core_help();
+        printf("Options:\n");
+        printf("  --threads N         Evaluate standard input with N threads (0: one per core).\n");
+        printf("                      Lines that do not use variables or random numbers are\n");
+        printf("                      evaluated in parallel; results are printed in order.\n");
+        printf("                      Otherwise, long lists of expressions on one line and\n");
+        printf("                      huge lists of numbers are evaluated with N threads.\n");
+        printf("  --threads MIN:MAX   Tune the number of threads within the given range\n");
+        printf("                      at the start of the run. 'auto' means 1:<cores>.\n");
+        printf("  --batch-size N      Read N lines per batch in parallel and column mode, or\n");
+        printf("  --batch-size MIN:MAX  tune the batch size within the given range (default\n");
+        printf("                      4096, or 64:65536 with a range of thread counts).\n");
+        printf("  --pin-threads       Pin evaluation threads to CPU cores.\n");
+        printf("  --columns a,b,...   Column mode: each line of standard input holds values\n");
+        printf("                      for the given variables, separated by blanks or commas.\n");
+        printf("                      The expression arguments are evaluated for each line\n");
+        printf("                      in one pass, sharing common subexpressions, and their\n");
+        printf("                      results are printed on one line. Expressions that\n");
+        printf("                      assign variables or use _ are evaluated row by row\n");
+        printf("                      in order, on one thread.\n");
+        printf("  --grid x=A:B:NX,y=C:D:NY\n");
+        printf("                      Grid mode: evaluate the expression argument for NX x NY\n");
+        printf("                      points with x from A to B and y from C to D, and write\n");
+        printf("                      the results as a raster. The first row holds y=C.\n");
+        printf("                      Uses all cores unless --threads is given.\n");
+        printf("  --npy a=A.npy,...   .npy mode: evaluate the expression arguments for all\n");
+        printf("                      rows of the given one-dimensional .npy arrays, which are\n");
+        printf("                      memory-mapped and bound to the variables. Uses all\n");
+        printf("                      cores unless --threads is given.\n");
+        printf("  --output FILE       Grid mode: raster file, .pfm (float), .pgm (16 bit,\n");
+        printf("                      values from [0,1]), or raw floats for other names;\n");
+        printf("                      without this option, raw floats go to standard output.\n");
+        printf("                      .npy mode: .npy file with one column of doubles per\n");
+        printf("                      expression; without this option, results are printed.\n");
+        printf("  --output-shards N PATTERN\n");
+        printf("                      In parallel and column mode, write results to N files\n");
+        printf("                      named by PATTERN with %%d replaced by 0..N-1. Each thread\n");
+        printf("                      writes its own shard. The manifest PATTERN with %%d\n");
+        printf("                      replaced by 'index' lists for each part of each shard:\n");
+        printf("                      first and last input line, number of output lines,\n");
+        printf("                      shard, byte offset, length.\n");
+        printf("  --check-precision   Estimate rounding errors of the results, for example\n");
+        printf("                      after cancellation, by evaluating with upward and\n");
+        printf("                      downward rounding. Affected expressions are evaluated\n");
+        printf("                      again with higher precision, or their results are\n");
+        printf("                      printed with the reliable digits only and the error\n");
+        printf("                      estimate.\n");
+        if (!precise_evaluation) {
+            printf("                      On this platform, long double has no higher\n");
+            printf("                      precision than double, so affected results are\n");
+            printf("                      always printed with their reliable digits only.\n");
+        }
+        printf("  --params FILE       Use the values in the parameter store FILE as variables.\n");
+        printf("                      The store is memory-mapped and shared by all processes\n");
+        printf("                      that use it; assignments only change the own copy.\n");
+        printf("  --params-create FILE\n");
+        printf("                      Create the parameter store FILE from lines of\n");
+        printf("                      'name value' on standard input, and exit.\n");
+        printf("  --lookup-cache      Keep parsed lookup() tables as binary files in\n");
+        printf("                      ~/.cache/mucalc and memory-map them on later runs.\n");
+        printf("  --explain           Print the expression arguments as trees after constant\n");
+        printf("                      folding, their operations by kind, whether they are\n");
+        printf("                      pure, and their cost per evaluation estimated from\n");
+        printf("                      measured operation costs, instead of evaluating them.\n");
+        printf("  --profile-ops       Attribute the evaluation time of the expression\n");
+        printf("                      arguments to their operations. Prints folded stacks\n");
+        printf("                      for flame graph tools (counts in ns per 1000\n");
+        printf("                      evaluations) and a summary on stderr. Self times\n");
+        printf("                      are estimated as differences of timings.\n");
+        printf("  --preview           Start interactive mode with the live preview enabled.\n");
+        printf("  --profile           Print timing statistics and tuning results to stderr.\n");
+        printf("  --                  End the options. Later arguments are expressions even\n");
+        printf("                      if they start with --.\n");
         printf("\n");
         printf("Report bugs to <marlam@marlam.de>.\n");
         return 0;
     }
 
+    // Options
+    Options options;
+    int explain_mode = 0;               // 1 for --explain, 2 for --profile-ops
+    bool batch_size_set = false;
+    int first_expr_arg = 1;
+    while (first_expr_arg < argc && strncmp(argv[first_expr_arg], "--", 2) == 0) {
+        const char* opt = argv[first_expr_arg];
+        const char* arg = (first_expr_arg + 1 < argc ? argv[first_expr_arg + 1] : NULL);
+        if (strcmp(opt, "--") == 0) {
+            first_expr_arg++;
+            break;
+        } else if (strcmp(opt, "--threads") == 0 && arg) {
+            long cores = std::max(1u, std::thread::hardware_concurrency());
+            long min_threads, max_threads;
+            if (strcmp(arg, "auto") == 0) {
+                min_threads = 1;
+                max_threads = cores;
+            } else if (!parse_range(arg, 0, 1024, &min_threads, &max_threads)) {
+                fprintf(stderr, "Invalid argument for %s: %s\n", opt, arg);
+                return 1;
+            }
+            min_threads = (min_threads > 0 ? min_threads : cores);
+            max_threads = (max_threads > 0 ? max_threads : cores);
+            if (min_threads > max_threads) {
+                fprintf(stderr, "Invalid argument for %s: %s\n", opt, arg);
+                return 1;
+            }
+            options.min_threads = min_threads;
+            options.max_threads = max_threads;
+            options.threads_set = true;
+            first_expr_arg += 2;
+        } else if (strcmp(opt, "--batch-size") == 0 && arg) {
+            long min_batch_size, max_batch_size;
+            if (!parse_range(arg, 1, 1 << 24, &min_batch_size, &max_batch_size)) {
+                fprintf(stderr, "Invalid argument for %s: %s\n", opt, arg);
+                return 1;
+            }
+            options.min_batch_size = min_batch_size;
+            options.max_batch_size = max_batch_size;
+            batch_size_set = true;
+            first_expr_arg += 2;
+        } else if (strcmp(opt, "--output-shards") == 0 && arg && first_expr_arg + 2 < argc) {
+            long shards, unused;
+            const char* pattern = argv[first_expr_arg + 2];
+            if (!parse_range(arg, 1, 1024, &shards, &unused) || unused != shards) {
+                fprintf(stderr, "Invalid argument for %s: %s\n", opt, arg);
+                return 1;
+            }
+            if (!strstr(pattern, "%d")) {
+                fprintf(stderr, "Shard file name pattern must contain %%d: %s\n", pattern);
+                return 1;
+            }
+            options.output_shards = shards;
+            options.output_pattern = pattern;
+            first_expr_arg += 3;
+        } else if (strcmp(opt, "--grid") == 0 && arg) {
+            if (!parse_grid(arg, options.grid)) {
+                fprintf(stderr, "Invalid argument for %s: %s\n", opt, arg);
+                return 1;
+            }
+            first_expr_arg += 2;
+        } else if (strcmp(opt, "--npy") == 0 && arg) {
+            // name=file,name=file,...
+            std::string list = arg;
+            size_t start = 0;
+            options.npy_columns.clear();
+            for (;;) {
+                size_t comma = list.find(',', start);
+                std::string item = list.substr(start, comma == std::string::npos ? comma : comma - start);
+                size_t eq = item.find('=');
+                if (eq == 0 || eq == std::string::npos || eq + 1 == item.size()) {
+                    fprintf(stderr, "Invalid argument for %s: %s\n", opt, arg);
+                    return 1;
+                }
+                options.npy_columns.push_back(std::make_pair(item.substr(0, eq), item.substr(eq + 1)));
+                if (comma == std::string::npos)
+                    break;
+                start = comma + 1;
+            }
+            first_expr_arg += 2;
+        } else if (strcmp(opt, "--output") == 0 && arg) {
+            options.output_file = arg;
+            first_expr_arg += 2;
+        } else if (strcmp(opt, "--params") == 0 && arg) {
+            if (!param_store.open(arg))
+                return 1;
+            first_expr_arg += 2;
+        } else if (strcmp(opt, "--params-create") == 0 && arg) {
+            return (ParamStore::create(arg, std::cin) ? 0 : 1);
+        } else if (strcmp(opt, "--explain") == 0) {
+            explain_mode = 1;
+            first_expr_arg++;
+        } else if (strcmp(opt, "--profile-ops") == 0) {
+            explain_mode = 2;
+            first_expr_arg++;
+        } else if (strcmp(opt, "--check-precision") == 0) {
+            check_precision = true;
+            first_expr_arg++;
+        } else if (strcmp(opt, "--preview") == 0) {
+            options.preview = true;
+            first_expr_arg++;
+        } else if (strcmp(opt, "--profile") == 0) {
+            profile.enabled = true;
+#ifdef MUCALC_COUNT_ALLOCATIONS
+            count_heap_allocations = true;
+#endif
+            first_expr_arg++;
+        } else if (strcmp(opt, "--pin-threads") == 0) {
+            options.pin_threads = true;
+            first_expr_arg++;
+        } else if (strcmp(opt, "--lookup-cache") == 0) {
+            lookup_cache_enabled = true;
+            first_expr_arg++;
+        } else if (strcmp(opt, "--columns") == 0 && arg) {
+            std::string columns = arg;
+            size_t start = 0;
+            for (;;) {
+                size_t comma = columns.find(',', start);
+                options.columns.push_back(columns.substr(start, comma == std::string::npos ? comma : comma - start));
+                if (comma == std::string::npos)
+                    break;
+                start = comma + 1;
+            }
+            first_expr_arg += 2;
+        } else if (is_option_name(opt)) {
+            fprintf(stderr, "Missing argument for option %s\n", opt);
+            return 1;
+        } else {
+            break;
+        }
+    }
+    // A range of thread counts is tuned together with the batch size
+    if (options.min_threads < options.max_threads && !batch_size_set) {
+        options.min_batch_size = 64;
+        options.max_batch_size = 65536;
+    }
+    if (!options.columns.empty() && argc == first_expr_arg) {
+        fprintf(stderr, "Column mode requires expression arguments\n");
+        return 1;
+    }
+    if (!options.grid.empty() && (argc - first_expr_arg != 1 || !options.columns.empty())) {
+        fprintf(stderr, "Grid mode requires exactly one expression argument\n");
+        return 1;
+    }
+    if (explain_mode) {
+        if (argc == first_expr_arg) {
+            fprintf(stderr, "%s requires expression arguments\n", explain_mode == 1 ? "--explain" : "--profile-ops");
+            return 1;
+        }
+        init_prng();
+        for (int i = first_expr_arg; i < argc; i++) {
+            ErrorContext context("Expression", i - first_expr_arg + 1);
+            if ((explain_mode == 1 ? explain(argv[i], context) : profile_ops(argv[i], context)) != 0)
+                retval = 1;
+        }
+        return retval;
+    }
+    if (!options.npy_columns.empty() && (argc == first_expr_arg || !options.columns.empty() || !options.grid.empty())) {
+        fprintf(stderr, ".npy mode requires expression arguments\n");
+        return 1;
+    }
+
     // Special variable _ for last result
     double last_result = 0.0;
 
     // Initialize the parser
     mu::Parser parser;
-    parser.ClearConst();
-    parser.DefineConst("e", e);
-    parser.DefineConst("pi", pi);
-    parser.DefineOprt("%", mod, mu::prMUL_DIV, mu::oaLEFT, true);
-    parser.DefineFun("deg", deg);
-    parser.DefineFun("rad", rad);
-    parser.DefineFun("atan2", atan2);
-    parser.DefineFun("fract", fract);
-    parser.DefineFun("pow", pow);
-    parser.DefineFun("exp2", exp2);
-    parser.DefineFun("cbrt", cbrt);
-    parser.DefineFun("int", int_);
-    parser.DefineFun("ceil", ceil);
-    parser.DefineFun("floor", floor);
-    parser.DefineFun("round", round);
-    parser.DefineFun("trunc", trunc);
-    parser.DefineFun("med", med);
-    parser.DefineFun("clamp", clamp);
-    parser.DefineFun("step", step);
-    parser.DefineFun("smoothstep", smoothstep);
-    parser.DefineFun("mix", mix);
-    parser.DefineFun("seed", seed, false);
-    parser.DefineFun("random", random_, false);
-    parser.DefineFun("gaussian", gaussian, false);
-    parser.DefineInfixOprt("+", unary_plus);
-    parser.SetVarFactory(add_var, NULL);
-    parser.DefineVar("_", &last_result);
+    init_parser(parser, &added_vars, &last_result);
 
     // Initialize the random number generator
-    prng.seed(std::chrono::system_clock::now().time_since_epoch().count());
+    init_prng();
+
+    bool stdin_parallel = !options.columns.empty()
+        || (argc == first_expr_arg && !isatty(fileno(stdin))
+                && (options.max_threads > 1 || options.output_shards > 0));
+    if (options.output_shards > 0 && !stdin_parallel) {
+        fprintf(stderr, "--output-shards requires parallel or column mode on standard input\n");
+        return 1;
+    }
+
+    // With --threads, evaluate long expression lists in parallel if possible,
+    // unless the threads are used for parallel evaluation of standard input
+    if (!stdin_parallel) {
+        list_threads = options.max_threads;
+        list_pin_threads = options.pin_threads;
+    }
+
+    // Evaluate standard input in column mode or with multiple threads
+    profile.start = std::chrono::steady_clock::now();
+    if (!options.grid.empty()) {
+        retval = eval_grid(options, argv[first_expr_arg]);
+        profile.print();
+        return retval;
+    }
+    if (!options.npy_columns.empty()) {
+        retval = eval_npy(options, std::vector<std::string>(argv + first_expr_arg, argv + argc));
+        profile.print();
+        return retval;
+    }
+    if (!options.columns.empty()) {
+        retval = eval_stdin_parallel(parser, &last_result, options,
+                fuse_column_exprs(std::vector<std::string>(argv + first_expr_arg, argv + argc)));
+        profile.print();
+        return retval;
+    }
 
     // Evaluate command line expression(s)
-    if (argc >= 2) {
-        for (int i = 1; i < argc; i++) {
-            std::string errmsg_prefix = std::string("Expression ") + std::to_string(i);
-            retval = eval_and_print(parser, &last_result, argv[i], errmsg_prefix);
+    if (argc > first_expr_arg) {
+        for (int i = first_expr_arg; i < argc; i++) {
+            retval = eval_and_print(parser, &last_result, argv[i],
+                    ErrorContext("Expression", i - first_expr_arg + 1));
         }
         return retval;
     }
@@ -409,49 +6050,26 @@ int main(int argc, char *argv[])
         free(inputrc_line);
         stifle_history(1000);
         read_history(history_file().c_str());
-        char* line;
-        bool quit_via_control_d = true;
         print_short_version();
         print_short_help();
-        while ((line = readline("> "))) {
-            std::string string_line = line;
-            std::string trimmed_line;
-            size_t first_nonspace = string_line.find_first_not_of(' ');
-            if (first_nonspace != std::string::npos) {
-                size_t last_nonspace = string_line.find_last_not_of(' ');
-                trimmed_line = string_line.substr(first_nonspace, last_nonspace - first_nonspace + 1);
-            }
-            if (!trimmed_line.empty())
-                add_history(line);
-            if (trimmed_line.empty()) {
-                print_short_help();
-            } else if (trimmed_line == "help" || trimmed_line == "?") {
-                print_core_help();
-            } else if (trimmed_line == "quit" || trimmed_line == "exit") {
-                quit_via_control_d = false;
-                break;
-            } else {
-                retval = eval_and_print(parser, &last_result, line);
-            }
-            free(line);
-        }
-        if (quit_via_control_d)
-            printf("^D\n");
-        free(line);
+        interactive_loop(parser, &last_result, &retval, options.preview);
         write_history(history_file().c_str());
+    } else if (stdin_parallel) {
+        retval = eval_stdin_parallel(parser, &last_result, options, ColumnExpr());
     } else {
         // use std::getline()
         size_t linecounter = 1;
+        std::string line;
         do {
-            std::string line;
             std::getline(std::cin, line);
             if (std::cin && !line.empty()) {
-                std::string errmsg_prefix = std::string("Line ") + std::to_string(linecounter);
-                retval = eval_and_print(parser, &last_result, line, errmsg_prefix);
+                retval = eval_and_print(parser, &last_result, line, ErrorContext("Line", linecounter));
+                profile.lines++;
             }
             linecounter++;
         }
         while (std::cin);
     }
+    profile.print();
     return retval;
 }
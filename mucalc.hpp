@@ -0,0 +1,623 @@
+/*
+ * Copyright (C) 2015, 2016, 2018, 2019, 2020, 2021
+ * Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Header-only C++ interface to the mucalc functions.
+ *
+ * The functions in namespace mucalc are the ones that mucalc registers with
+ * muparser, so C++ code that uses them computes exactly what mucalc computes.
+ *
+ * For formulas that are known at compile time, the expression templates in
+ * namespace mucalc::expr compose the same operators and functions without
+ * any parsing at runtime. The compiler sees the whole formula and can inline
+ * and vectorize it:
+ *
+ *   using namespace mucalc::expr;
+ *   auto x = arg<0>();
+ *   auto y = arg<1>();
+ *   auto f = smoothstep(x, 0.0, 1.0) * mix(y, 2.0, 0.5) + (x > y);
+ *   double r = f(0.3, 4.0);
+ *   f.eval(n, columns, results); // results[i] = f(columns[0][i], columns[1][i])
+ *
+ * The operators have C++ precedence. Use pow() for '^' and cond() for '?:'.
+ * The functions seed, random, and gaussian are not available here.
+ */
+
+#ifndef MUCALC_HPP
+#define MUCALC_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include <tuple>
+#include <type_traits>
+
+
+namespace mucalc {
+
+/* constants */
+
+const double e = 2.7182818284590452353602874713526625;
+const double pi = 3.1415926535897932384626433832795029;
+
+/* operators */
+
+inline double mod(double x, double y)
+{
+    return x - y * std::floor(x / y);
+}
+
+/* functions */
+
+inline double deg(double x)
+{
+    return x * 180.0 / pi;
+}
+
+inline double rad(double x)
+{
+    return x * pi / 180.0;
+}
+
+inline double int_(double x)
+{
+    return (int)x;
+}
+
+inline double fract(double x)
+{
+    return x - std::floor(x);
+}
+
+inline double sign(double x)
+{
+    return (x < 0.0 ? -1.0 : x > 0.0 ? 1.0 : 0.0);
+}
+
+inline double clamp(double x, double minval, double maxval)
+{
+    return std::min(maxval, std::max(minval, x));
+}
+
+inline double step(double x, double edge)
+{
+    return (x < edge ? 0.0 : 1.0);
+}
+
+inline double smoothstep(double x, double edge0, double edge1)
+{
+    double t = clamp((x - edge0) / (edge1 - edge0), 0.0, 1.0);
+    return t * t * (3.0 - t * 2.0);
+}
+
+inline double mix(double x, double y, double t)
+{
+    return x * (1.0 - t) + y * t;
+}
+
+/* special functions */
+
+// std::lgamma() stores the sign of gamma in the global variable signgam on
+// many platforms, which is a data race when several threads call it. The
+// reentrant variants are used where they are available.
+#if defined(__GLIBC__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+inline double lgamma(double x)
+{
+    int sign;
+    return ::lgamma_r(x, &sign);
+}
+
+inline long double lgamma(long double x)
+{
+    int sign;
+    return ::lgammal_r(x, &sign);
+}
+#else
+inline double lgamma(double x)
+{
+    return std::lgamma(x);
+}
+
+inline long double lgamma(long double x)
+{
+    return std::lgamma(x);
+}
+#endif
+
+inline double beta(double a, double b)
+{
+    if (a > 0.0 && b > 0.0)
+        return std::exp(lgamma(a) + lgamma(b) - lgamma(a + b));
+    else
+        return std::tgamma(a) * std::tgamma(b) / std::tgamma(a + b);
+}
+
+// Cumulative distribution function of the standard normal distribution
+inline double normcdf(double x)
+{
+    return 0.5 * std::erfc(-x * 0.70710678118654752440);
+}
+
+// Quantile function of the standard normal distribution: a rational
+// approximation by P. J. Acklam, refined by one step of Halley's method
+inline double norminv(double p)
+{
+    static const double a[] = { -3.969683028665376e+01, 2.209460984245205e+02,
+        -2.759285104469687e+02, 1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00 };
+    static const double b[] = { -5.447609879822406e+01, 1.615858368580409e+02,
+        -1.556989798598866e+02, 6.680131188771972e+01, -1.328068155288572e+01 };
+    static const double c[] = { -7.784894002430293e-03, -3.223964580411365e-01,
+        -2.400758277161838e+00, -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00 };
+    static const double d[] = { 7.784695709041462e-03, 3.224671290700398e-01,
+        2.445134137142996e+00, 3.754408661907416e+00 };
+    if (!(p > 0.0 && p < 1.0))
+        return (p == 0.0 ? -INFINITY : p == 1.0 ? INFINITY : NAN);
+    double x, e;
+    if (p < 0.02425 || p > 1.0 - 0.02425) {
+        double q = std::sqrt(-2.0 * std::log(std::min(p, 1.0 - p)));
+        x = (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5])
+            / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1.0);
+        if (p > 0.5) {
+            x = -x;
+            e = (1.0 - p) - 0.5 * std::erfc(x * 0.70710678118654752440);
+        } else {
+            e = normcdf(x) - p;
+        }
+    } else {
+        double q = p - 0.5;
+        double r = q * q;
+        x = (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q
+            / (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1.0);
+        // avoid cancellation near the median
+        e = 0.5 * std::erf(x * 0.70710678118654752440) - q;
+    }
+    double u = e * 2.50662827463100050242 * std::exp(x * x / 2.0);
+    // exp() overflows for subnormal p; the approximation is then used as is
+    if (!std::isfinite(u))
+        return x;
+    return x - u / (1.0 + x * u / 2.0);
+}
+
+/* functions with a variable number of arguments */
+
+// Sums are computed in a fixed order that does not depend on how the work is
+// split between threads: blocks of sum_block_size values are summed in
+// order, and the block sums are added pairwise. Parallel code that sums the
+// blocks on any number of threads and then calls pairwise_sum() on the block
+// sums gets bit-identical results. Up to sum_block_size values, this is
+// plain summation.
+const size_t sum_block_size = 4096;
+
+template<typename T> inline T block_sum(const T* x, size_t n)
+{
+    T s = 0;
+    for (size_t i = 0; i < n; i++)
+        s += x[i];
+    return s;
+}
+
+template<typename T> inline T pairwise_sum(const T* x, size_t n)
+{
+    if (n <= 2)
+        return (n == 0 ? 0 : n == 1 ? x[0] : x[0] + x[1]);
+    size_t half = n / 2;
+    return pairwise_sum(x, half) + pairwise_sum(x + half, n - half);
+}
+
+// The sum in the order described above, also for other types such as long double
+template<typename T> inline T ordered_sum(const T* x, size_t n)
+{
+    if (n <= sum_block_size)
+        return block_sum(x, n);
+    std::vector<T> block_sums;
+    for (size_t i = 0; i < n; i += sum_block_size)
+        block_sums.push_back(block_sum(x + i, std::min(sum_block_size, n - i)));
+    return pairwise_sum(block_sums.data(), block_sums.size());
+}
+
+inline double sum(const double* x, int n)
+{
+    return ordered_sum(x, n > 0 ? n : 0);
+}
+
+inline double avg(const double* x, int n)
+{
+    return sum(x, n) / n;
+}
+
+inline double min(const double* x, int n)
+{
+    double m = x[0];
+    for (int i = 1; i < n; i++)
+        m = std::min(m, x[i]);
+    return m;
+}
+
+inline double max(const double* x, int n)
+{
+    double m = x[0];
+    for (int i = 1; i < n; i++)
+        m = std::max(m, x[i]);
+    return m;
+}
+
+inline double med(const double* x, int n)
+{
+    // Selection instead of sorting keeps huge argument lists linear
+    std::vector<double> values(x, x + n);
+    std::nth_element(values.begin(), values.begin() + n / 2, values.end());
+    if (n % 2 == 1) {
+        return values[n / 2];
+    } else {
+        double lower = *std::max_element(values.begin(), values.begin() + n / 2);
+        return (lower + values[n / 2]) / 2.0;
+    }
+}
+
+
+namespace expr {
+
+/* expression nodes */
+
+// Base of all expression nodes. Each node E implements
+// double eval(const double* const* columns, size_t i) const,
+// where argument k of row i is columns[k][i].
+template<typename E>
+struct Expr
+{
+    const E& derived() const
+    {
+        return static_cast<const E&>(*this);
+    }
+
+    // Evaluate with the given arguments
+    template<typename... T>
+    double operator()(T... args) const
+    {
+        const double values[] = { static_cast<double>(args)..., 0.0 };
+        const double* columns[sizeof...(T) + 1];
+        for (size_t k = 0; k < sizeof...(T) + 1; k++)
+            columns[k] = values + k;
+        return derived().eval(columns, 0);
+    }
+
+    // Evaluate n rows of argument columns
+    void eval(size_t n, const double* const* columns, double* results) const
+    {
+        for (size_t i = 0; i < n; i++)
+            results[i] = derived().eval(columns, i);
+    }
+};
+
+struct Constant : Expr<Constant>
+{
+    using Expr<Constant>::eval;
+    double value;
+
+    explicit Constant(double v) : value(v)
+    {
+    }
+
+    double eval(const double* const*, size_t) const
+    {
+        return value;
+    }
+};
+
+template<size_t I>
+struct Arg : Expr<Arg<I>>
+{
+    using Expr<Arg<I>>::eval;
+
+    double eval(const double* const* columns, size_t i) const
+    {
+        return columns[I][i];
+    }
+};
+
+// Argument I of the expression
+template<size_t I>
+Arg<I> arg()
+{
+    return Arg<I>();
+}
+
+template<typename F, typename A>
+struct Unary : Expr<Unary<F, A>>
+{
+    using Expr<Unary<F, A>>::eval;
+    A a;
+
+    explicit Unary(const A& a_) : a(a_)
+    {
+    }
+
+    double eval(const double* const* columns, size_t i) const
+    {
+        return F::apply(a.eval(columns, i));
+    }
+};
+
+template<typename F, typename A, typename B>
+struct Binary : Expr<Binary<F, A, B>>
+{
+    using Expr<Binary<F, A, B>>::eval;
+    A a;
+    B b;
+
+    Binary(const A& a_, const B& b_) : a(a_), b(b_)
+    {
+    }
+
+    double eval(const double* const* columns, size_t i) const
+    {
+        return F::apply(a.eval(columns, i), b.eval(columns, i));
+    }
+};
+
+template<typename F, typename A, typename B, typename C>
+struct Ternary : Expr<Ternary<F, A, B, C>>
+{
+    using Expr<Ternary<F, A, B, C>>::eval;
+    A a;
+    B b;
+    C c;
+
+    Ternary(const A& a_, const B& b_, const C& c_) : a(a_), b(b_), c(c_)
+    {
+    }
+
+    double eval(const double* const* columns, size_t i) const
+    {
+        return F::apply(a.eval(columns, i), b.eval(columns, i), c.eval(columns, i));
+    }
+};
+
+// The condition operator evaluates only the chosen branch
+template<typename A, typename B, typename C>
+struct Conditional : Expr<Conditional<A, B, C>>
+{
+    using Expr<Conditional<A, B, C>>::eval;
+    A a;
+    B b;
+    C c;
+
+    Conditional(const A& a_, const B& b_, const C& c_) : a(a_), b(b_), c(c_)
+    {
+    }
+
+    double eval(const double* const* columns, size_t i) const
+    {
+        return (a.eval(columns, i) != 0.0 ? b.eval(columns, i) : c.eval(columns, i));
+    }
+};
+
+template<size_t... I> struct Indices {};
+template<size_t N, size_t... I> struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+template<size_t... I> struct MakeIndices<0, I...> { typedef Indices<I...> type; };
+
+// Functions with a variable number of arguments get them as an array, like
+// the muparser callbacks
+template<typename F, typename... A>
+struct Variadic : Expr<Variadic<F, A...>>
+{
+    using Expr<Variadic<F, A...>>::eval;
+    std::tuple<A...> args;
+
+    explicit Variadic(const A&... a) : args(a...)
+    {
+    }
+
+    template<size_t... I>
+    double eval(const double* const* columns, size_t i, Indices<I...>) const
+    {
+        const double values[] = { std::get<I>(args).eval(columns, i)... };
+        return F::apply(values, sizeof...(A));
+    }
+
+    double eval(const double* const* columns, size_t i) const
+    {
+        return eval(columns, i, typename MakeIndices<sizeof...(A)>::type());
+    }
+};
+
+/* operands: expressions and numbers */
+
+template<typename T, typename Enable = void>
+struct Operand
+{
+    static const bool is_expr = false;
+};
+
+template<typename T>
+struct Operand<T, typename std::enable_if<std::is_base_of<Expr<T>, T>::value>::type>
+{
+    static const bool is_expr = true;
+    typedef T type;
+    static const T& get(const T& x)
+    {
+        return x;
+    }
+};
+
+template<typename T>
+struct Operand<T, typename std::enable_if<std::is_arithmetic<T>::value>::type>
+{
+    static const bool is_expr = false;
+    typedef Constant type;
+    static Constant get(T x)
+    {
+        return Constant(x);
+    }
+};
+
+// At least one operand must be an expression, so that operators on plain
+// numbers are unaffected
+template<typename... T> struct AnyExpr;
+template<> struct AnyExpr<> : std::false_type {};
+template<typename T, typename... R> struct AnyExpr<T, R...>
+    : std::integral_constant<bool, Operand<T>::is_expr || AnyExpr<R...>::value> {};
+
+#define MUCALC_EXPR_RESULT2(F, A, B) \
+    typename std::enable_if<AnyExpr<A, B>::value, \
+        Binary<F, typename Operand<A>::type, typename Operand<B>::type>>::type
+#define MUCALC_EXPR_RESULT3(F, A, B, C) \
+    typename std::enable_if<AnyExpr<A, B, C>::value, \
+        Ternary<F, typename Operand<A>::type, typename Operand<B>::type, typename Operand<C>::type>>::type
+
+/* operators and functions */
+
+namespace ops {
+struct neg { static double apply(double x) { return -x; } };
+}
+
+template<typename A>
+Unary<ops::neg, A> operator-(const Expr<A>& a)
+{
+    return Unary<ops::neg, A>(a.derived());
+}
+
+template<typename A>
+A operator+(const Expr<A>& a)
+{
+    return a.derived();
+}
+
+#define MUCALC_EXPR_UNARY_FUNCTION(name, impl) \
+    namespace ops { struct name { static double apply(double x) { return impl(x); } }; } \
+    template<typename A> \
+    Unary<ops::name, A> name(const Expr<A>& a) \
+    { \
+        return Unary<ops::name, A>(a.derived()); \
+    }
+
+#define MUCALC_EXPR_BINARY(op, name, impl) \
+    namespace ops { struct name { static double apply(double x, double y) { return impl; } }; } \
+    template<typename A, typename B> \
+    MUCALC_EXPR_RESULT2(ops::name, A, B) op(const A& a, const B& b) \
+    { \
+        return MUCALC_EXPR_RESULT2(ops::name, A, B)(Operand<A>::get(a), Operand<B>::get(b)); \
+    }
+
+#define MUCALC_EXPR_TERNARY_FUNCTION(name, impl) \
+    namespace ops { struct name { static double apply(double x, double y, double z) { return impl(x, y, z); } }; } \
+    template<typename A, typename B, typename C> \
+    MUCALC_EXPR_RESULT3(ops::name, A, B, C) name(const A& a, const B& b, const C& c) \
+    { \
+        return MUCALC_EXPR_RESULT3(ops::name, A, B, C)( \
+                Operand<A>::get(a), Operand<B>::get(b), Operand<C>::get(c)); \
+    }
+
+#define MUCALC_EXPR_VARIADIC_FUNCTION(name, impl) \
+    namespace ops { struct name { static double apply(const double* x, int n) { return impl(x, n); } }; } \
+    template<typename... A> \
+    typename std::enable_if<AnyExpr<A...>::value, Variadic<ops::name, typename Operand<A>::type...>>::type \
+    name(const A&... a) \
+    { \
+        return Variadic<ops::name, typename Operand<A>::type...>(Operand<A>::get(a)...); \
+    }
+
+MUCALC_EXPR_BINARY(operator+, add, x + y)
+MUCALC_EXPR_BINARY(operator-, sub, x - y)
+MUCALC_EXPR_BINARY(operator*, mul, x * y)
+MUCALC_EXPR_BINARY(operator/, div, x / y)
+MUCALC_EXPR_BINARY(operator%, mod, mucalc::mod(x, y))
+MUCALC_EXPR_BINARY(operator==, eq, x == y)
+MUCALC_EXPR_BINARY(operator!=, ne, x != y)
+MUCALC_EXPR_BINARY(operator<, lt, x < y)
+MUCALC_EXPR_BINARY(operator>, gt, x > y)
+MUCALC_EXPR_BINARY(operator<=, le, x <= y)
+MUCALC_EXPR_BINARY(operator>=, ge, x >= y)
+MUCALC_EXPR_BINARY(operator&&, logical_and, x != 0.0 && y != 0.0)
+MUCALC_EXPR_BINARY(operator||, logical_or, x != 0.0 || y != 0.0)
+MUCALC_EXPR_BINARY(pow, pow, std::pow(x, y))
+MUCALC_EXPR_BINARY(atan2, atan2, std::atan2(x, y))
+MUCALC_EXPR_BINARY(step, step, mucalc::step(x, y))
+MUCALC_EXPR_BINARY(beta, beta, mucalc::beta(x, y))
+
+MUCALC_EXPR_UNARY_FUNCTION(deg, mucalc::deg)
+MUCALC_EXPR_UNARY_FUNCTION(rad, mucalc::rad)
+MUCALC_EXPR_UNARY_FUNCTION(sin, std::sin)
+MUCALC_EXPR_UNARY_FUNCTION(asin, std::asin)
+MUCALC_EXPR_UNARY_FUNCTION(cos, std::cos)
+MUCALC_EXPR_UNARY_FUNCTION(acos, std::acos)
+MUCALC_EXPR_UNARY_FUNCTION(tan, std::tan)
+MUCALC_EXPR_UNARY_FUNCTION(atan, std::atan)
+MUCALC_EXPR_UNARY_FUNCTION(sinh, std::sinh)
+MUCALC_EXPR_UNARY_FUNCTION(asinh, std::asinh)
+MUCALC_EXPR_UNARY_FUNCTION(cosh, std::cosh)
+MUCALC_EXPR_UNARY_FUNCTION(acosh, std::acosh)
+MUCALC_EXPR_UNARY_FUNCTION(tanh, std::tanh)
+MUCALC_EXPR_UNARY_FUNCTION(atanh, std::atanh)
+MUCALC_EXPR_UNARY_FUNCTION(exp, std::exp)
+MUCALC_EXPR_UNARY_FUNCTION(exp2, std::exp2)
+MUCALC_EXPR_UNARY_FUNCTION(log, std::log)
+MUCALC_EXPR_UNARY_FUNCTION(ln, std::log)
+MUCALC_EXPR_UNARY_FUNCTION(log2, std::log2)
+MUCALC_EXPR_UNARY_FUNCTION(log10, std::log10)
+MUCALC_EXPR_UNARY_FUNCTION(sqrt, std::sqrt)
+MUCALC_EXPR_UNARY_FUNCTION(cbrt, std::cbrt)
+MUCALC_EXPR_UNARY_FUNCTION(abs, std::fabs)
+MUCALC_EXPR_UNARY_FUNCTION(sign, mucalc::sign)
+MUCALC_EXPR_UNARY_FUNCTION(fract, mucalc::fract)
+MUCALC_EXPR_UNARY_FUNCTION(int_, mucalc::int_)
+MUCALC_EXPR_UNARY_FUNCTION(ceil, std::ceil)
+MUCALC_EXPR_UNARY_FUNCTION(floor, std::floor)
+MUCALC_EXPR_UNARY_FUNCTION(round, std::round)
+MUCALC_EXPR_UNARY_FUNCTION(rint, std::rint)
+MUCALC_EXPR_UNARY_FUNCTION(trunc, std::trunc)
+MUCALC_EXPR_UNARY_FUNCTION(erf, std::erf)
+MUCALC_EXPR_UNARY_FUNCTION(erfc, std::erfc)
+MUCALC_EXPR_UNARY_FUNCTION(tgamma, std::tgamma)
+MUCALC_EXPR_UNARY_FUNCTION(lgamma, mucalc::lgamma)
+MUCALC_EXPR_UNARY_FUNCTION(normcdf, mucalc::normcdf)
+MUCALC_EXPR_UNARY_FUNCTION(norminv, mucalc::norminv)
+
+MUCALC_EXPR_TERNARY_FUNCTION(clamp, mucalc::clamp)
+MUCALC_EXPR_TERNARY_FUNCTION(smoothstep, mucalc::smoothstep)
+MUCALC_EXPR_TERNARY_FUNCTION(mix, mucalc::mix)
+
+MUCALC_EXPR_VARIADIC_FUNCTION(min, mucalc::min)
+MUCALC_EXPR_VARIADIC_FUNCTION(max, mucalc::max)
+MUCALC_EXPR_VARIADIC_FUNCTION(sum, mucalc::sum)
+MUCALC_EXPR_VARIADIC_FUNCTION(avg, mucalc::avg)
+MUCALC_EXPR_VARIADIC_FUNCTION(med, mucalc::med)
+
+// cond(a, b, c) is mucalc's a ? b : c
+template<typename A, typename B, typename C>
+typename std::enable_if<AnyExpr<A, B, C>::value,
+    Conditional<typename Operand<A>::type, typename Operand<B>::type, typename Operand<C>::type>>::type
+cond(const A& a, const B& b, const C& c)
+{
+    return Conditional<typename Operand<A>::type, typename Operand<B>::type, typename Operand<C>::type>(
+            Operand<A>::get(a), Operand<B>::get(b), Operand<C>::get(c));
+}
+
+#undef MUCALC_EXPR_RESULT2
+#undef MUCALC_EXPR_RESULT3
+#undef MUCALC_EXPR_UNARY_FUNCTION
+#undef MUCALC_EXPR_BINARY
+#undef MUCALC_EXPR_TERNARY_FUNCTION
+#undef MUCALC_EXPR_VARIADIC_FUNCTION
+
+}
+
+}
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2015, 2016, 2018, 2019, 2020, 2021
+ * Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Accuracy of the special functions in mucalc.hpp, compared with reference
+// values (computed with SciPy) and with the C math library.
+
+#include <cstdio>
+#include <cmath>
+
+#include "mucalc.hpp"
+
+static int failures = 0;
+
+static void check(const char* what, double x, double result, double expected, double tolerance)
+{
+    double error = std::fabs(result - expected);
+    if (expected != 0.0)
+        error /= std::fabs(expected);
+    if (!(error <= tolerance)) {
+        printf("%s(%.17g) = %.17g, expected %.17g (relative error %.3g, tolerance %.3g)\n",
+                what, x, result, expected, error, tolerance);
+        failures++;
+    }
+}
+
+struct Reference
+{
+    double x;
+    double expected;
+    double tolerance;
+};
+
+static const Reference norminv_table[] = {
+    // subnormal p has only a few significant bits
+    { 5e-324, -38.467405617144344, 1e-8 },
+    { 1e-300, -37.047096299361201, 1e-14 },
+    { 1e-100, -21.273453560965322, 1e-14 },
+    { 1e-20, -9.2623400897984087, 1e-14 },
+    { 1e-10, -6.3613409024040557, 1e-14 },
+    { 1e-05, -4.2648907939228247, 1e-14 },
+    { 0.001, -3.0902323061678132, 1e-14 },
+    { 0.02, -2.053748910631823, 1e-14 },
+    { 0.02425, -1.9729610513118849, 1e-14 },
+    { 0.1, -1.2815515655446004, 1e-14 },
+    { 0.3, -0.52440051270804089, 1e-14 },
+    { 0.5, 0.0, 1e-14 },
+    { 0.7, 0.52440051270804067, 1e-14 },
+    { 0.9, 1.2815515655446004, 1e-14 },
+    { 0.975, 1.959963984540054, 1e-14 },
+    { 0.999, 3.0902323061678132, 1e-14 },
+    { 0.9999999999, 6.3613408896974217, 1e-9 }, // 1 - p is inexact
+};
+
+static const Reference normcdf_table[] = {
+    { -37.0, 5.7255712225239266e-300, 1e-13 },
+    { -20.0, 2.7536241186061556e-89, 1e-13 },
+    { -10.0, 7.6198530241604696e-24, 1e-14 },
+    { -5.0, 2.8665157187919328e-07, 1e-14 },
+    { -1.0, 0.15865525393145707, 1e-15 },
+    { 0.0, 0.5, 1e-15 },
+    { 0.5, 0.69146246127401312, 1e-15 },
+    { 1.0, 0.84134474606854293, 1e-15 },
+    { 3.0, 0.9986501019683699, 1e-15 },
+    { 8.0, 0.99999999999999933, 1e-15 },
+};
+
+static const Reference lgamma_table[] = {
+    { 0.5, 0.57236494292469997, 1e-15 },
+    { 1.5, -0.12078223763524526, 1e-15 },
+    { 2.5, 0.28468287047291918, 1e-15 },
+    { 10.0, 12.801827480081469, 1e-15 },
+    { 100.0, 359.1342053695754, 1e-15 },
+    { 100000.0, 1051287.7089736569, 1e-15 },
+    { -0.5, 1.2655121234846454, 1e-15 },
+    { -2.5, -0.056243716497674012, 1e-14 },
+    { 1e-08, 18.420680738180209, 1e-15 },
+};
+
+struct BetaReference
+{
+    double a, b;
+    double expected;
+    double tolerance;
+};
+
+static const BetaReference beta_table[] = {
+    { 0.5, 0.5, 3.1415926535897927, 1e-14 },
+    { 2.0, 3.0, 0.083333333333333329, 1e-14 },
+    { 10.0, 20.0, 4.9925087406346778e-09, 1e-13 },
+    { 0.1, 100.0, 6.0053229390930971, 1e-13 },
+    { 100.0, 200.0, 3.6072854497944921e-84, 1e-12 }, // exp() of a difference of large lgammas
+    { -0.5, 2.0, -3.9999999999999996, 1e-14 },
+};
+
+int main()
+{
+    for (const Reference& r : norminv_table)
+        check("norminv", r.x, mucalc::norminv(r.x), r.expected, r.tolerance);
+    for (const Reference& r : normcdf_table)
+        check("normcdf", r.x, mucalc::normcdf(r.x), r.expected, r.tolerance);
+    for (const Reference& r : lgamma_table)
+        check("lgamma", r.x, mucalc::lgamma(r.x), r.expected, r.tolerance);
+    for (const BetaReference& r : beta_table)
+        check("beta", r.a, mucalc::beta(r.a, r.b), r.expected, r.tolerance);
+
+    // Compare with the C math library
+    for (int i = 1; i < 1000; i++) {
+        double p = i / 1000.0;
+        check("normcdf(norminv)", p, mucalc::normcdf(mucalc::norminv(p)), p, 1e-14);
+    }
+    for (int i = 1; i <= 300; i++) {
+        double p = std::pow(10.0, -i);
+        check("normcdf(norminv)", p, mucalc::normcdf(mucalc::norminv(p)), p, 1e-12);
+    }
+    for (double x = -9.75; x < 170.0; x += 0.5)
+        check("lgamma", x, mucalc::lgamma(x), std::log(std::fabs(std::tgamma(x))), 1e-13);
+    for (double a = 0.25; a < 30.0; a += 1.5)
+        for (double b = 0.25; b < 30.0; b += 2.5)
+            check("beta", a, mucalc::beta(a, b), std::tgamma(a) * std::tgamma(b) / std::tgamma(a + b), 1e-12);
+
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}